@@ -0,0 +1,437 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include "protocol.h"
+
+#define BUFFER_SIZE 1024
+#define RESPONSE_SIZE 16384
+#define MAX_HOT_COURSES 64
+
+// Load generator: simulated students run a weighted mix of LOGIN,
+// VIEW_COURSES, ENROLL and UNENROLL against a few hot courses while
+// simulated faculty list their enrollments. Throughput, outcome counts and
+// latency percentiles per command are reported.
+
+// Commands the benchmark sends
+enum Command {
+    CMD_LOGIN,
+    CMD_VIEW,
+    CMD_ENROLL,
+    CMD_UNENROLL,
+    CMD_ENROLLMENTS,
+    COMMAND_COUNT
+};
+
+const char* command_names[COMMAND_COUNT] = {
+    "LOGIN", "VIEW_COURSES", "ENROLL", "UNENROLL", "VIEW_ENROLLMENTS"
+};
+
+// Benchmark settings
+int num_threads = 16;
+int students_per_thread = 4;
+int num_faculty = 0;
+int hot_courses = 1;
+int seats = 10;
+int duration = 5;
+int mix[CMD_ENROLLMENTS] = { 0, 0, 1, 1 };  // weights of the student commands
+const char* admin_username = "admin";
+const char* admin_password = "admin123";
+
+// Latencies of one command, in microseconds
+typedef struct {
+    double* samples;
+    long count;
+    long capacity;
+    long errors;
+} Latencies;
+
+// One simulated client: a thread driving its students (each on its own
+// connection) or one faculty member
+typedef struct {
+    ServerLink* links;
+    int link_count;
+    char (*usernames)[64];
+    int faculty;
+    unsigned int seed;
+    long enrolled;      // successful ENROLLs
+    long full;          // ENROLLs rejected because the course was full
+    long unenrolled;    // successful UNENROLLs
+    Latencies latencies[COMMAND_COUNT];
+} Client;
+
+char hot_course[MAX_HOT_COURSES][64];
+volatile int running = 1;
+
+// Open a connection to the server
+static void connectServer(ServerLink* link) {
+    if (openServerLink(link) < 0) {
+        perror("Connection failed: Server might be offline");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Send one framed request and read its response into response (truncated to
+// RESPONSE_SIZE - 1). Returns -1 if the connection failed.
+int sendRequest(ServerLink* link, const char* request, char* response) {
+    unsigned int id = submitRequest(link, request);
+    if (!id) return -1;
+    size_t len;
+    char* data = awaitResponse(link, id, &len);
+    if (!data) return -1;
+    if (len > RESPONSE_SIZE - 1) len = RESPONSE_SIZE - 1;
+    memcpy(response, data, len);
+    response[len] = '\0';
+    free(data);
+    return 0;
+}
+
+// Send a setup request that must succeed
+static void mustSend(ServerLink* link, const char* request, char* response, const char* expect) {
+    if (sendRequest(link, request, response) < 0 || !strstr(response, expect)) {
+        fprintf(stderr, "Setup failed: %s -> %s\n", request, response);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void recordLatency(Latencies* latencies, double us) {
+    if (latencies->count == latencies->capacity) {
+        latencies->capacity = latencies->capacity ? latencies->capacity * 2 : 4096;
+        latencies->samples = (double*)realloc(latencies->samples, latencies->capacity * sizeof(double));
+    }
+    latencies->samples[latencies->count++] = us;
+}
+
+// Send a timed request. Returns -1 if the connection failed.
+static int timedRequest(Client* client, ServerLink* link, enum Command command,
+                        const char* request, char* response) {
+    double start = now();
+    int status = sendRequest(link, request, response);
+    recordLatency(&client->latencies[command], (now() - start) * 1e6);
+    if (status < 0) client->latencies[command].errors++;
+    return status;
+}
+
+// Pick a student command according to the mix
+static enum Command pickCommand(unsigned int* seed) {
+    int total = 0;
+    for (int c = 0; c < CMD_ENROLLMENTS; c++) total += mix[c];
+    int r = rand_r(seed) % total;
+    for (int c = 0; c < CMD_ENROLLMENTS; c++) {
+        if (r < mix[c]) return (enum Command)c;
+        r -= mix[c];
+    }
+    return CMD_VIEW;
+}
+
+// Random hot course whose enrolled bit equals want, or -1 if there is none
+static int pickCourse(unsigned long long enrolled, int want, unsigned int* seed) {
+    int start = rand_r(seed) % hot_courses;
+    for (int i = 0; i < hot_courses; i++) {
+        int course = (start + i) % hot_courses;
+        if ((int)((enrolled >> course) & 1) == want) return course;
+    }
+    return -1;
+}
+
+// One step of a student: run a command from the mix and check its response
+static int studentStep(Client* client, int i, unsigned long long* enrolled) {
+    char request[BUFFER_SIZE];
+    char response[RESPONSE_SIZE];
+    ServerLink* link = &client->links[i];
+    enum Command command = pickCommand(&client->seed);
+
+    // ENROLL needs a course the student is not in, UNENROLL one it is in
+    int course = -1;
+    if (command == CMD_ENROLL || command == CMD_UNENROLL) {
+        course = pickCourse(*enrolled, command == CMD_UNENROLL, &client->seed);
+        if (course < 0) {
+            command = command == CMD_ENROLL ? CMD_UNENROLL : CMD_ENROLL;
+            course = pickCourse(*enrolled, command == CMD_UNENROLL, &client->seed);
+        }
+    }
+
+    switch (command) {
+    case CMD_LOGIN:
+        snprintf(request, sizeof(request), "LOGIN %s pw", client->usernames[i]);
+        break;
+    case CMD_ENROLL:
+    case CMD_UNENROLL:
+        snprintf(request, sizeof(request), "%s %s", command_names[command], hot_course[course]);
+        break;
+    default:
+        snprintf(request, sizeof(request), "VIEW_COURSES");
+        break;
+    }
+    if (timedRequest(client, link, command, request, response) < 0) return -1;
+
+    int ok;
+    if (command == CMD_LOGIN) {
+        ok = strncmp(response, "LOGIN_SUCCESS STUDENT", 21) == 0;
+    } else if (command == CMD_VIEW) {
+        ok = strncmp(response, "Available courses:", 18) == 0;
+    } else if (strncmp(response, "Successfully enrolled", 21) == 0) {
+        ok = command == CMD_ENROLL;
+        client->enrolled++;
+        *enrolled |= 1ULL << course;
+    } else if (strncmp(response, "Successfully unenrolled", 23) == 0) {
+        ok = command == CMD_UNENROLL;
+        client->unenrolled++;
+        *enrolled &= ~(1ULL << course);
+    } else if (strcmp(response, "Course is full") == 0) {
+        ok = command == CMD_ENROLL;
+        client->full++;
+    } else {
+        ok = 0;
+    }
+    if (!ok) client->latencies[command].errors++;
+    return 0;
+}
+
+// Students run commands from the mix in turn; a faculty member lists the
+// enrollments of its courses
+void* runClient(void* arg) {
+    Client* client = (Client*)arg;
+    char response[RESPONSE_SIZE];
+
+    if (client->faculty) {
+        while (running) {
+            if (timedRequest(client, &client->links[0], CMD_ENROLLMENTS, "VIEW_ENROLLMENTS", response) < 0) break;
+            if (strncmp(response, "Course enrollments:", 19) != 0 &&
+                strncmp(response, "You have not offered", 20) != 0) {
+                client->latencies[CMD_ENROLLMENTS].errors++;
+            }
+        }
+        return NULL;
+    }
+
+    unsigned long long* enrolled = (unsigned long long*)calloc(client->link_count, sizeof(unsigned long long));
+    for (int i = 0; running; i = (i + 1) % client->link_count) {
+        if (studentStep(client, i, &enrolled[i]) < 0) break;
+    }
+
+    // Leave the courses as we found them
+    for (int i = 0; i < client->link_count; i++) {
+        for (int course = 0; course < hot_courses; course++) {
+            if (!((enrolled[i] >> course) & 1)) continue;
+            char request[BUFFER_SIZE];
+            if (snprintf(request, sizeof(request), "UNENROLL %s", hot_course[course]) >= (int)sizeof(request)) continue;
+            sendRequest(&client->links[i], request, response);
+        }
+    }
+    free(enrolled);
+    return NULL;
+}
+
+static int compareDoubles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Value below which the given fraction of the sorted samples falls
+static double percentile(const Latencies* latencies, double fraction) {
+    if (latencies->count == 0) return 0;
+    long index = (long)(fraction * latencies->count);
+    if (index >= latencies->count) index = latencies->count - 1;
+    return latencies->samples[index];
+}
+
+// Parse "login=W,view=W,enroll=W,unenroll=W"; commands left out get weight 0
+static int parseMix(char* text) {
+    memset(mix, 0, sizeof(mix));
+    for (char* part = strtok(text, ","); part; part = strtok(NULL, ",")) {
+        char* equals = strchr(part, '=');
+        if (!equals) return -1;
+        *equals = '\0';
+        int weight = atoi(equals + 1);
+        if (weight < 0) return -1;
+        if (strcmp(part, "login") == 0) mix[CMD_LOGIN] = weight;
+        else if (strcmp(part, "view") == 0) mix[CMD_VIEW] = weight;
+        else if (strcmp(part, "enroll") == 0) mix[CMD_ENROLL] = weight;
+        else if (strcmp(part, "unenroll") == 0) mix[CMD_UNENROLL] = weight;
+        else return -1;
+    }
+    int total = 0;
+    for (int c = 0; c < CMD_ENROLLMENTS; c++) total += mix[c];
+    return total > 0 ? 0 : -1;
+}
+
+int main(int argc, char* argv[]) {
+    // Parse command line options
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            num_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--students") == 0 && i + 1 < argc) {
+            students_per_thread = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--faculty") == 0 && i + 1 < argc) {
+            num_faculty = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--courses") == 0 && i + 1 < argc) {
+            hot_courses = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--seats") == 0 && i + 1 < argc) {
+            seats = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) {
+            duration = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--mix") == 0 && i + 1 < argc) {
+            if (parseMix(argv[++i]) < 0) {
+                fprintf(stderr, "Invalid mix; expected e.g. login=5,view=25,enroll=40,unenroll=30\n");
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--admin") == 0 && i + 2 < argc) {
+            admin_username = argv[++i];
+            admin_password = argv[++i];
+        } else {
+            fprintf(stderr, "Usage: %s [--threads N] [--students N] [--faculty N] [--courses N] [--seats N] "
+                            "[--seconds N] [--mix login=W,view=W,enroll=W,unenroll=W] [--admin USER PASSWORD]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (num_threads < 1 || students_per_thread < 1 || seats < 1 || duration < 1 ||
+        hot_courses < 1 || num_faculty < 0) {
+        fprintf(stderr, "All counts must be positive\n");
+        exit(EXIT_FAILURE);
+    }
+    if (hot_courses > MAX_HOT_COURSES) {
+        fprintf(stderr, "At most %d courses\n", MAX_HOT_COURSES);
+        exit(EXIT_FAILURE);
+    }
+
+    // Set up a faculty member, the hot courses and the students, with names
+    // unique to this run so the benchmark can be repeated against one server
+    char request[BUFFER_SIZE];
+    char response[RESPONSE_SIZE];
+    ServerLink setup, faculty;
+    connectServer(&setup);
+    connectServer(&faculty);
+    int tag = (int)getpid();
+
+    snprintf(request, sizeof(request), "LOGIN %s %s", admin_username, admin_password);
+    mustSend(&setup, request, response, "LOGIN_SUCCESS ADMIN");
+
+    snprintf(request, sizeof(request), "ADD_FACULTY benchfac%d pw", tag);
+    mustSend(&setup, request, response, "with ID");
+    snprintf(request, sizeof(request), "LOGIN benchfac%d pw", tag);
+    mustSend(&faculty, request, response, "LOGIN_SUCCESS FACULTY");
+
+    for (int c = 0; c < hot_courses; c++) {
+        snprintf(hot_course[c], sizeof(hot_course[c]), "HOT%d_%d", tag, c);
+        snprintf(request, sizeof(request), "ADD_COURSE %s %d Benchmark hot course", hot_course[c], seats);
+        mustSend(&faculty, request, response, "Course added");
+    }
+
+    int num_clients = num_threads + num_faculty;
+    Client* clients = (Client*)calloc(num_clients, sizeof(Client));
+    for (int t = 0; t < num_clients; t++) {
+        Client* client = &clients[t];
+        client->faculty = t >= num_threads;
+        client->link_count = client->faculty ? 1 : students_per_thread;
+        client->links = (ServerLink*)malloc(client->link_count * sizeof(ServerLink));
+        client->usernames = (char(*)[64])malloc(client->link_count * sizeof(*client->usernames));
+        client->seed = (unsigned int)(tag * 31 + t);
+        for (int i = 0; i < client->link_count; i++) {
+            ServerLink* link = &client->links[i];
+            connectServer(link);
+            if (client->faculty) {
+                // Every simulated faculty member shares the courses' owner
+                snprintf(client->usernames[i], 64, "benchfac%d", tag);
+                snprintf(request, sizeof(request), "LOGIN %s pw", client->usernames[i]);
+                mustSend(link, request, response, "LOGIN_SUCCESS FACULTY");
+            } else {
+                snprintf(client->usernames[i], 64, "bench%d_%d_%d", tag, t, i);
+                snprintf(request, sizeof(request), "ADD_STUDENT %s pw", client->usernames[i]);
+                mustSend(&setup, request, response, "with ID");
+                snprintf(request, sizeof(request), "LOGIN %s pw", client->usernames[i]);
+                mustSend(link, request, response, "LOGIN_SUCCESS STUDENT");
+            }
+        }
+    }
+
+    printf("%d hot course%s of %d seats, %d clients x %d students, %d faculty, mix login=%d view=%d enroll=%d unenroll=%d, %d s\n",
+           hot_courses, hot_courses == 1 ? "" : "s", seats, num_threads, students_per_thread, num_faculty,
+           mix[CMD_LOGIN], mix[CMD_VIEW], mix[CMD_ENROLL], mix[CMD_UNENROLL], duration);
+
+    // Run
+    pthread_t* threads = (pthread_t*)malloc(num_clients * sizeof(pthread_t));
+    double start = now();
+    for (int t = 0; t < num_clients; t++) {
+        pthread_create(&threads[t], NULL, runClient, &clients[t]);
+    }
+    sleep(duration);
+    running = 0;
+    for (int t = 0; t < num_clients; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    double elapsed = now() - start;
+
+    // Merge the per-client results
+    long enrolled = 0, full = 0, unenrolled = 0, errors = 0, total = 0;
+    Latencies merged[COMMAND_COUNT];
+    memset(merged, 0, sizeof(merged));
+    for (int t = 0; t < num_clients; t++) {
+        enrolled += clients[t].enrolled;
+        full += clients[t].full;
+        unenrolled += clients[t].unenrolled;
+        for (int c = 0; c < COMMAND_COUNT; c++) {
+            Latencies* latencies = &clients[t].latencies[c];
+            for (long i = 0; i < latencies->count; i++) recordLatency(&merged[c], latencies->samples[i]);
+            merged[c].errors += latencies->errors;
+            free(latencies->samples);
+        }
+        for (int i = 0; i < clients[t].link_count; i++) {
+            close(clients[t].links[i].fd);
+        }
+        free(clients[t].links);
+        free(clients[t].usernames);
+    }
+
+    // Report
+    printf("%-17s %9s %7s %10s %9s %9s %9s %9s\n",
+           "Command", "Count", "Errors", "Req/s", "p50 ms", "p95 ms", "p99 ms", "p99.9 ms");
+    for (int c = 0; c < COMMAND_COUNT; c++) {
+        Latencies* latencies = &merged[c];
+        total += latencies->count;
+        errors += latencies->errors;
+        if (latencies->count == 0) continue;
+        qsort(latencies->samples, latencies->count, sizeof(double), compareDoubles);
+        printf("%-17s %9ld %7ld %10.0f %9.3f %9.3f %9.3f %9.3f\n", command_names[c],
+               latencies->count, latencies->errors, latencies->count / elapsed,
+               percentile(latencies, 0.50) / 1000, percentile(latencies, 0.95) / 1000,
+               percentile(latencies, 0.99) / 1000, percentile(latencies, 0.999) / 1000);
+        free(latencies->samples);
+    }
+    printf("Requests:   %ld in %.2f s (%.0f req/s)\n", total, elapsed, total / elapsed);
+    printf("Enrolled:   %ld\n", enrolled);
+    printf("Full:       %ld\n", full);
+    printf("Unenrolled: %ld\n", unenrolled);
+    printf("Errors:     %ld\n", errors);
+
+    // The seat counts must never have gone past the capacity, and every seat
+    // must have been given back
+    int consistent = 1;
+    if (sendRequest(&faculty, "VIEW_COURSES", response) == 0) {
+        for (int c = 0; c < hot_courses; c++) {
+            char expect[128];
+            snprintf(expect, sizeof(expect), "Code: %s, Name: Benchmark hot course, Enrollment: 0/%d",
+                     hot_course[c], seats);
+            if (!strstr(response, expect)) consistent = 0;
+        }
+        printf("Final seats: %s\n", consistent ? "consistent" : "INCONSISTENT");
+    }
+    for (int c = 0; c < hot_courses; c++) {
+        if (snprintf(request, sizeof(request), "REMOVE_COURSE %s", hot_course[c]) >= (int)sizeof(request)) continue;
+        sendRequest(&faculty, request, response);
+    }
+    close(faculty.fd);
+    close(setup.fd);
+
+    free(threads);
+    free(clients);
+    return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
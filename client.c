@@ -2,25 +2,22 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <arpa/inet.h>
-#include <netinet/in.h>
-#include <sys/socket.h>
 #include <signal.h>
 #include <stdbool.h>
+#include "protocol.h"
 
-#define PORT 8080
 #define BUFFER_SIZE 1024
-#define SERVER_IP "127.0.0.1"
 #define MAX_USERNAME_LENGTH 100
 #define MAX_PASSWORD_LENGTH 100
 #define MAX_COURSE_NAME_LENGTH 100
 #define MAX_RESPONSE_LENGTH 1024
 
 // Global variables
-int client_fd = -1;
+ServerLink server = { -1, 1, NULL };
 bool is_logged_in = false;
 char current_user_type[20] = "";
 int current_user_id = -1;
+char* last_response = NULL;   // returned by sendRequest, freed on the next call
 
 // Function prototypes
 void getParam(const char* str, char* result, int token_index);
@@ -30,9 +27,8 @@ void displayError(const char* message);
 void displaySuccess(const char* message);
 void waitForEnter();
 void Exit(int signal_num);
-struct sockaddr_in configureServerAddress(const char *ip, int port);
 void connectServer();
-void sendRequest(const char* request, char* response);
+char* sendRequest(const char* request);
 void loginMenu();
 void adminMenu();  
 void studentMenu(); 
@@ -82,39 +78,14 @@ void waitForEnter() {
 
 void Exit(int signal_num) {
     printf("\nExiting client application...\n");
-    if (client_fd != -1) {
-        close(client_fd);
+    if (server.fd != -1) {
+        close(server.fd);
     }
     exit(signal_num);
 }
 
-struct sockaddr_in configureServerAddress(const char *ip, int port) {
-    struct sockaddr_in serv_addr;
-    memset(&serv_addr, 0, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(port);
-
-    if (inet_pton(AF_INET, ip, &serv_addr.sin_addr) <= 0) {
-        perror("Invalid address or address not supported\n");
-        exit(EXIT_FAILURE);
-    }
-
-    return serv_addr;
-}
-
 void connectServer() {
-    // Create socket
-    client_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (client_fd < 0) {
-        perror("Socket creation error\n");
-        exit(EXIT_FAILURE);
-    }
-
-    // Configure server address
-    struct sockaddr_in serv_addr = configureServerAddress(SERVER_IP, PORT);
-
-    // Connect to server
-    if (connect(client_fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
+    if (openServerLink(&server) < 0) {
         perror("Connection failed: Server might be offline\n");
         exit(EXIT_FAILURE);
     }
@@ -122,28 +93,20 @@ void connectServer() {
     printf("Connected to Academia Portal Server\n");
 }
 
-void sendRequest(const char* request, char* response) {
-    // Initialize response buffer
-    memset(response, 0, BUFFER_SIZE);
-    
-    // Send request to server
-    if (send(client_fd, request, strlen(request), 0) < 0) {
+// Send a request and wait for its response. The returned string stays valid
+// until the next call.
+char* sendRequest(const char* request) {
+    free(last_response);
+    last_response = NULL;
+    unsigned int id = submitRequest(&server, request);
+    if (!id) {
         fprintf(stderr, "Failed to send request\n");
-        strcpy(response, "ERROR");
-        return;
-    }
-    
-    // Receive response from server
-    ssize_t bytesRead = read(client_fd, response, BUFFER_SIZE - 1);
-    
-    if (bytesRead < 0) {
-        fprintf(stderr, "Failed to read response\n");
-        strcpy(response, "ERROR");
-        return;
+    } else {
+        last_response = awaitResponse(&server, id, NULL);
+        if (!last_response) fprintf(stderr, "Failed to read response\n");
     }
-    
-    // Ensure null termination
-    response[bytesRead] = '\0';
+    if (!last_response) last_response = strdup("ERROR");
+    return last_response;
 }
 
 void loginMenu() {
@@ -154,7 +117,7 @@ void loginMenu() {
         char username[MAX_USERNAME_LENGTH];
         char password[MAX_PASSWORD_LENGTH];
         char request[BUFFER_SIZE];
-        char response[BUFFER_SIZE];
+        char* response;
         
         printf("Username: ");
         scanf("%s", username);
@@ -166,10 +129,10 @@ void loginMenu() {
         
         // Send login request
         snprintf(request, BUFFER_SIZE, "LOGIN %s %s", username, password);
-        sendRequest(request, response);
+        response = sendRequest(request);
         
         // Process login response from server
-        if (strcmp(response, "LOGIN_SUCCESS") == 0) {
+        if (strncmp(response, "LOGIN_SUCCESS", 13) == 0) {
             // Login successful - update user status
             is_logged_in = true;
             
@@ -236,7 +199,7 @@ void adminMenu() {
         getchar(); // Clear input buffer
         
         char request[BUFFER_SIZE];
-        char response[BUFFER_SIZE];
+        char* response;
         
         switch (choice) {
             case 1: { // Add Student
@@ -255,7 +218,7 @@ void adminMenu() {
                 getchar(); // Clear input buffer
                 
                 snprintf(request, BUFFER_SIZE, "ADMIN %d ADD_STUDENT %s %s", current_user_id, username, password);
-                sendRequest(request, response);
+                response = sendRequest(request);
                 
                 displaySuccess(response);
                 break;
@@ -272,11 +235,11 @@ void adminMenu() {
                 getchar(); // Clear input buffer
                 
                 printf("Enter password: ");
-                gscanf("%s", password);
+                scanf("%s", password);
                 getchar(); // Clear input buffer
                 
                 snprintf(request, BUFFER_SIZE, "ADMIN %d ADD_FACULTY %s %s", current_user_id, username, password);
-                sendRequest(request, response);
+                response = sendRequest(request);
                 
                 displaySuccess(response);
                 break;
@@ -292,7 +255,7 @@ void adminMenu() {
                 getchar(); // Clear input buffer
                 
                 snprintf(request, BUFFER_SIZE, "ADMIN %d TOGGLE_STUDENT %d", current_user_id, studentId);
-                sendRequest(request, response);
+                response = sendRequest(request);
                 
                 displaySuccess(response);
                 break;
@@ -324,7 +287,7 @@ void adminMenu() {
                 }
                 
                 snprintf(request, BUFFER_SIZE, "ADMIN %d UPDATE_USER %d %s %s", current_user_id, userId, field, value);
-                sendRequest(request, response);
+                response = sendRequest(request);
                 
                 displaySuccess(response);
                 break;
@@ -334,7 +297,7 @@ void adminMenu() {
                 displayTitle("All Users");
                 
                 snprintf(request, BUFFER_SIZE, "ADMIN %d VIEW_USERS", current_user_id);
-                sendRequest(request, response);
+                response = sendRequest(request);
                 
                 printf("%s\n", response);
                 waitForEnter();
@@ -345,7 +308,7 @@ void adminMenu() {
                 displayTitle("All Courses");
                 
                 snprintf(request, BUFFER_SIZE, "ADMIN %d VIEW_COURSES", current_user_id);
-                sendRequest(request, response);
+                response = sendRequest(request);
                 
                 printf("%s\n", response);
                 waitForEnter();
@@ -360,7 +323,7 @@ void adminMenu() {
                 return; // Return to login menu
             }
             case 8: { // Exit
-                sendRequest("EXIT", response);
+                sendRequest("EXIT");
                 Exit(0);
                 break;
             }
@@ -390,7 +353,7 @@ void studentMenu() {
         getchar(); // Clear input buffer
         
         char request[BUFFER_SIZE];
-        char response[BUFFER_SIZE];
+        char* response;
         
         switch (choice) {
             case 1: { // Enroll to new course
@@ -399,7 +362,7 @@ void studentMenu() {
                 
                 // First, show available courses
                 snprintf(request, BUFFER_SIZE, "STUDENT %d VIEW_COURSES", current_user_id);
-                sendRequest(request, response);
+                response = sendRequest(request);
                 printf("%s\n", response);
                 
                 char courseCode[20];
@@ -408,7 +371,7 @@ void studentMenu() {
                 getchar(); // Clear input buffer
                 
                 snprintf(request, BUFFER_SIZE, "STUDENT %d ENROLL %s", current_user_id, courseCode);
-                sendRequest(request, response);
+                response = sendRequest(request);
                 
                 displaySuccess(response);
                 break;
@@ -419,7 +382,7 @@ void studentMenu() {
                 
                 // First, show enrolled courses
                 snprintf(request, BUFFER_SIZE, "STUDENT %d VIEW_ENROLLED", current_user_id);
-                sendRequest(request, response);
+                response = sendRequest(request);
                 printf("%s\n", response);
                 
                 char courseCode[20];
@@ -428,7 +391,7 @@ void studentMenu() {
                 getchar(); // Clear input buffer
                 
                 snprintf(request, BUFFER_SIZE, "STUDENT %d UNENROLL %s", current_user_id, courseCode);
-                sendRequest(request, response);
+                response = sendRequest(request);
                 
                 displaySuccess(response);
                 break;
@@ -438,7 +401,7 @@ void studentMenu() {
                 displayTitle("Your Enrolled Courses");
                 
                 snprintf(request, BUFFER_SIZE, "STUDENT %d VIEW_ENROLLED", current_user_id);
-                sendRequest(request, response);
+                response = sendRequest(request);
                 
                 printf("%s\n", response);
                 waitForEnter();
@@ -449,7 +412,7 @@ void studentMenu() {
                 displayTitle("All Available Courses");
                 
                 snprintf(request, BUFFER_SIZE, "STUDENT %d VIEW_COURSES", current_user_id);
-                sendRequest(request, response);
+                response = sendRequest(request);
                 
                 printf("%s\n", response);
                 waitForEnter();
@@ -471,7 +434,7 @@ void studentMenu() {
                 getchar(); // Clear input buffer
 
                 snprintf(request, BUFFER_SIZE, "STUDENT %d CHANGE_PASSWORD %s %s", current_user_id, oldPassword, newPassword);
-                sendRequest(request, response);
+                response = sendRequest(request);
                 
                 displaySuccess(response);
                 break;
@@ -485,7 +448,7 @@ void studentMenu() {
                 return; // Return to login menu
             }
             case 7: { // Exit
-                sendRequest("EXIT", response);
+                sendRequest("EXIT");
                 Exit(0);
                 break;
             }
@@ -515,7 +478,7 @@ void facultyMenu() {
         getchar(); // Clear input buffer
         
         char request[BUFFER_SIZE];
-        char response[BUFFER_SIZE];
+        char* response;
         
         switch (choice) {
             case 1: { // Add new course
@@ -543,7 +506,7 @@ void facultyMenu() {
                 }
                 
                 snprintf(request, BUFFER_SIZE, "FACULTY %d ADD_COURSE %s %d %s", current_user_id, courseCode, seats, courseName);
-                sendRequest(request, response);
+                response = sendRequest(request);
                 
                 displaySuccess(response);
                 break;
@@ -554,7 +517,7 @@ void facultyMenu() {
                 
                 // First, show faculty's courses
                 snprintf(request, BUFFER_SIZE, "FACULTY %d VIEW_COURSES", current_user_id);
-                sendRequest(request, response);
+                response = sendRequest(request);
                 printf("%s\n", response);
                 
                 char courseCode[20];
@@ -563,7 +526,7 @@ void facultyMenu() {
                 getchar(); // Clear input buffer
                 
                 snprintf(request, BUFFER_SIZE, "FACULTY %d REMOVE_COURSE %s", current_user_id, courseCode);
-                sendRequest(request, response);
+                response = sendRequest(request);
                 
                 displaySuccess(response);
                 break;
@@ -573,7 +536,7 @@ void facultyMenu() {
                 displayTitle("Course Enrollments");
                 
                 snprintf(request, BUFFER_SIZE, "FACULTY %d VIEW_ENROLLMENTS", current_user_id);
-                sendRequest(request, response);
+                response = sendRequest(request);
                 
                 printf("%s\n", response);
                 waitForEnter();
@@ -584,7 +547,7 @@ void facultyMenu() {
                 displayTitle("Your Courses");
                 
                 snprintf(request, BUFFER_SIZE, "FACULTY %d VIEW_COURSES", current_user_id);
-                sendRequest(request, response);
+                response = sendRequest(request);
                 
                 printf("%s\n", response);
                 waitForEnter();
@@ -606,7 +569,7 @@ void facultyMenu() {
                 getchar(); // Clear input buffer
 
                 snprintf(request, BUFFER_SIZE, "FACULTY %d CHANGE_PASSWORD %s %s", current_user_id, oldPassword, newPassword);
-                sendRequest(request, response);
+                response = sendRequest(request);
                 
                 displaySuccess(response);
                 break;
@@ -620,7 +583,7 @@ void facultyMenu() {
                 return; // Return to login menu
             }
             case 7: { // Exit
-                sendRequest("EXIT", response);
+                sendRequest("EXIT");
                 Exit(0);
                 break;
             }
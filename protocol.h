@@ -0,0 +1,136 @@
+// Client side of the server's framed protocol, shared by client.c and bench.c.
+// Each message is <length:4> <request id:4> <payload>, both header fields
+// big-endian. The server echoes the request id, so several requests may be in
+// flight on one connection. A long response arrives in several frames, all but
+// the last marked with FRAME_MORE in their length, and is reassembled here.
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define PORT 8080
+#define SERVER_IP "127.0.0.1"
+#define FRAME_HEADER_SIZE 8
+#define FRAME_MORE 0x80000000u
+
+// A response that arrived, possibly in part, while waiting for another id
+typedef struct PendingResponse {
+    unsigned int id;
+    char* data;
+    size_t len;
+    int complete;
+    struct PendingResponse* next;
+} PendingResponse;
+
+// A framed connection to the server
+typedef struct {
+    int fd;
+    unsigned int next_id;
+    PendingResponse* pending;
+} ServerLink;
+
+// Connect to the server. Returns 0, or -1 with errno set.
+static inline int openServerLink(ServerLink* link) {
+    memset(link, 0, sizeof(*link));
+    link->next_id = 1;
+    link->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (link->fd < 0) return -1;
+    struct sockaddr_in serv_addr;
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_port = htons(PORT);
+    inet_pton(AF_INET, SERVER_IP, &serv_addr.sin_addr);
+    if (connect(link->fd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
+        close(link->fd);
+        link->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+// Read exactly len bytes
+static inline int readFully(int fd, char* buffer, size_t len) {
+    while (len > 0) {
+        ssize_t bytesRead = read(fd, buffer, len);
+        if (bytesRead <= 0) return -1;
+        buffer += bytesRead;
+        len -= bytesRead;
+    }
+    return 0;
+}
+
+// Send a request frame without waiting for the reply. Returns the request id,
+// or 0 if sending failed.
+static inline unsigned int submitRequest(ServerLink* link, const char* request) {
+    size_t len = strlen(request);
+    char* frame = (char*)malloc(FRAME_HEADER_SIZE + len);
+    unsigned int id = link->next_id++;
+    uint32_t length = htonl((uint32_t)len);
+    uint32_t frameId = htonl(id);
+    memcpy(frame, &length, 4);
+    memcpy(frame + 4, &frameId, 4);
+    memcpy(frame + FRAME_HEADER_SIZE, request, len);
+
+    ssize_t sent = send(link->fd, frame, FRAME_HEADER_SIZE + len, 0);
+    free(frame);
+    return sent == (ssize_t)(FRAME_HEADER_SIZE + len) ? id : 0;
+}
+
+// Find the (possibly partial) response stashed for an id, creating it if needed
+static inline PendingResponse* pendingResponse(ServerLink* link, unsigned int id) {
+    for (PendingResponse* p = link->pending; p; p = p->next) {
+        if (p->id == id) return p;
+    }
+    PendingResponse* p = (PendingResponse*)calloc(1, sizeof(PendingResponse));
+    p->id = id;
+    p->data = strdup("");
+    p->next = link->pending;
+    link->pending = p;
+    return p;
+}
+
+// Wait for the response to the request with the given id. Returns the whole
+// response in a malloc'd string of *len bytes (len may be NULL), or NULL if
+// the connection failed.
+static inline char* awaitResponse(ServerLink* link, unsigned int id, size_t* len) {
+    PendingResponse* target = pendingResponse(link, id);
+
+    while (!target->complete) {
+        char header[FRAME_HEADER_SIZE];
+        if (readFully(link->fd, header, FRAME_HEADER_SIZE) < 0) return NULL;
+        uint32_t length, frameId;
+        memcpy(&length, header, 4);
+        memcpy(&frameId, header + 4, 4);
+        length = ntohl(length);
+        frameId = ntohl(frameId);
+        int more = (length & FRAME_MORE) != 0;
+        length &= ~FRAME_MORE;
+
+        PendingResponse* p = pendingResponse(link, frameId);
+        p->data = (char*)realloc(p->data, p->len + length + 1);
+        if (readFully(link->fd, p->data + p->len, length) < 0) return NULL;
+        p->len += length;
+        p->data[p->len] = '\0';
+        p->complete = !more;
+    }
+
+    for (PendingResponse** p = &link->pending; *p; p = &(*p)->next) {
+        if (*p == target) {
+            *p = target->next;
+            break;
+        }
+    }
+    char* data = target->data;
+    if (len) *len = target->len;
+    free(target);
+    return data;
+}
+
+#endif
@@ -1,4 +1,5 @@
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,8 +12,17 @@
 #include <signal.h>
 #include <fcntl.h>
 #include <sys/stat.h>
-#include <sys/file.h>
 #include <semaphore.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <crypt.h>
 
 #define PORT 8080
 #define MAX_CLIENTS 100
@@ -22,6 +32,47 @@
 #define MAX_COURSES 1000
 #define MAX_ENROLLMENTS 10000
 #define MAX_STR 256
+#define JOURNAL_CHECKPOINT_RECORDS 1000
+#define MAX_EVENTS 64
+#define DEFAULT_EVENT_LOOPS 4
+#define WORK_QUEUE_SIZE 1024
+#define DEFAULT_AUTH_THREADS 2
+#define PASSWORD_HASH_PREFIX "$y$"  // yescrypt, see crypt(5)
+#define PASSWORD_HASH_SIZE 128      // room for a yescrypt hash with default parameters
+#define UNKNOWN_USER_HASH "$y$j9T$dVcy0cmUC5rlo75OAlYQy0$Xuvldy.Qay0iAsDFBZwT4/wmrvQvcL2MFbFE3GLDRo6"
+#define FRAME_HEADER_SIZE 8
+#define MAX_FRAME_SIZE (1 << 20)
+#define FRAME_MORE 0x80000000u
+#define RESPONSE_CHUNK_SIZE 16384
+#define COURSE_LOCK_STRIPES 64
+#define OUTPUT_IOVECS 64           // pieces of output written per sendmsg()
+#define DEFAULT_BGSAVE_CHANGES 1000
+#define DEFAULT_BGSAVE_INTERVAL 60
+#define SAVE_DELAY_MS 50
+#define SNAPSHOT_MAGIC "CRSNAP1"   // 8 bytes with the terminator
+#define SNAPSHOT_VERSION 3
+#define SNAPSHOT_SECTIONS 5
+#define SNAPSHOT_BYTE_ORDER 0x01020304u
+#define MAX_COMMAND_ARGS 3
+#define COMMAND_TABLE_SIZE 128      // power of two, well above the number of commands
+#define WORD_DELIMITERS " \r\n"
+#define COMMAND_STRUCTURAL 1        // inserts, removes or rewrites users or courses
+#define COMMAND_READ_ONLY 2         // only reads, so making no change is not a failure
+#define COMMAND_TEXT 4              // needs free text after its arguments
+#define COMMAND_PASSWORD 8          // sets a password, which is hashed before the table lock
+#define MAX_COMMANDS 32             // entries the command table may have
+#define STAT_LOGIN MAX_COMMANDS     // request kinds counted besides the commands
+#define STAT_BATCH (MAX_COMMANDS + 1)
+#define STAT_OTHER (MAX_COMMANDS + 2)
+#define STAT_KINDS (MAX_COMMANDS + 3)
+#define LATENCY_BUCKETS 24
+#define LOADER_CHUNK_BYTES (256 * 1024)  // smallest chunk of a text file given its own loader thread
+#define MAX_LOADER_THREADS 8        // loader threads per text file
+#define COMPACTION_MIN_TOMBSTONES 64 // compact once a table has this many tombstones
+#define COMPACTION_RATIO 4           // and they are at least 1/4 of its slots
+#define SEAT_LOG_SIZE 4096          // power of two; seat changes the catalog can patch from
+#define INDEX_EMPTY -1
+#define INDEX_DELETED -2
 
 // Semaphore for controlling access to critical sections
 sem_t mutex;
@@ -33,23 +84,27 @@ enum UserType {
     FACULTY = 3
 };
 
-// Structure to hold user information
+// Offset of a string in the string pool
+typedef uint32_t StringRef;
+
+// Structure to hold user information. Strings are kept in the string pool,
+// so records are small and fixed-size and scans over them stay in cache.
 typedef struct {
     int id;
-    char username[MAX_STR];
-    char password[MAX_STR];
-    enum UserType type;
-    int active; // 1 for true, 0 for false
+    StringRef username;
+    StringRef password;
+    unsigned char type;     // enum UserType
+    unsigned char active;   // 1 for true, 0 for false
 } User;
 
 // Structure to hold course information
 typedef struct {
     int id;
-    char code[MAX_STR];
-    char name[MAX_STR];
+    StringRef code;
+    StringRef name;
     int facultyId;
     int totalSeats;
-    int enrolledStudents;
+    int enrolledStudents;   // claimed with reserveSeat()/releaseSeat() while serving
 } Course;
 
 // Structure to hold enrollment information
@@ -58,6 +113,32 @@ typedef struct {
     int courseId;
 } Enrollment;
 
+// Open-addressing hash index over one of the data arrays. Slots hold array
+// positions (or INDEX_EMPTY / INDEX_DELETED); keys are read from the array
+// itself, so hashAt() gives the hash of the record at a position.
+typedef struct {
+    int* slots;
+    int capacity;   // power of two
+    int used;       // live plus deleted slots
+    unsigned int (*hashAt)(int position);
+} HashIndex;
+
+// Growable list of ids (courses of a student, or students of a course)
+typedef struct {
+    int* ids;
+    int size;
+    int capacity;
+} IdList;
+
+// FIFO of ids (a course's waitlist), kept in a ring buffer so that taking
+// the head off is O(1)
+typedef struct {
+    int* ids;
+    int head;       // position of the first id in ids
+    int size;
+    int capacity;
+} IdQueue;
+
 // Global variables for storing data
 User* users = NULL;
 int users_size = 0;
@@ -66,754 +147,5089 @@ int courses_size = 0;
 Enrollment* enrollments = NULL;
 int enrollments_size = 0;
 
+// String pool. Each distinct username, password, course code and name is
+// stored once, NUL-terminated; records refer to it by offset, which stays
+// valid when the pool grows and moves. The pool only grows (a replaced
+// string stays behind), and like the arrays it changes only under the
+// exclusive table lock. Offset 0 is the empty string.
+char* string_pool = NULL;
+size_t string_pool_len = 0;
+size_t string_pool_cap = 0;
+StringRef* intern_slots = NULL;     // open-addressing set of pool offsets, 0 = empty
+size_t intern_capacity = 0;         // power of two
+size_t intern_count = 0;
+
+// Lookup indexes, kept in sync with the users and courses arrays
+unsigned int hashUserIdAt(int position);
+unsigned int hashUsernameAt(int position);
+unsigned int hashCourseIdAt(int position);
+unsigned int hashCourseCodeAt(int position);
+HashIndex userIdIndex = { NULL, 0, 0, hashUserIdAt };
+HashIndex usernameIndex = { NULL, 0, 0, hashUsernameAt };
+HashIndex courseIdIndex = { NULL, 0, 0, hashCourseIdAt };
+HashIndex courseCodeIndex = { NULL, 0, 0, hashCourseCodeAt };
+
+// Enrollment indexes: (studentId, courseId) -> position in enrollments, plus
+// adjacency lists kept parallel to the users and courses arrays
+unsigned int hashEnrollmentAt(int position);
+HashIndex enrollmentIndex = { NULL, 0, 0, hashEnrollmentAt };
+IdList* studentCourses = NULL;   // studentCourses[i]: course ids of users[i]
+IdList* courseStudents = NULL;   // courseStudents[i]: student ids of courses[i]
+IdQueue* courseWaitlists = NULL; // courseWaitlists[i]: students waiting for courses[i], in order
+__thread Enrollment* flat_waitlists = NULL;  // flattenWaitlists() of the thread's last save
+__thread int flat_waitlists_cap = 0;
+
+// Removed courses and enrollments stay in their slots as tombstones (id 0,
+// studentId 0), so no other record moves and Course pointers stay valid while
+// requests run. The free slot lists hold their positions for reuse by the
+// next insert. The compactor thread squeezes the tombstones out under the
+// exclusive table lock once they make up enough of a table.
+IdList freeCourseSlots = { NULL, 0, 0 };
+IdList freeEnrollmentSlots = { NULL, 0, 0 };    // guarded by enrollment_lock
+int last_course_id = 0;                         // highest course id handed out
+unsigned long compactions = 0;
+int compaction_requested = 0;
+pthread_mutex_t compaction_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t compaction_wanted = PTHREAD_COND_INITIALIZER;
+
+// The VIEW_COURSES listings are rendered once and kept (see CatalogCache).
+// catalog_version moves whenever a listed course or faculty username changes,
+// which happens under the exclusive table lock; catalog_seats_version moves
+// whenever a seat count does, as ENROLL and UNENROLL do under the shared lock.
+// Each seat change also logs the course's position in seat_log, under the
+// sequence number it took from catalog_seats_version, so the listings only
+// patch the rows of the courses that changed.
+unsigned long catalog_version = 1;
+unsigned long catalog_seats_version = 1;
+uint64_t seat_log[SEAT_LOG_SIZE];   // sequence number << 32 | position in courses
+
+static void catalogChanged() {
+    __atomic_fetch_add(&catalog_version, 1, __ATOMIC_RELAXED);
+}
+
+// Called after a course's seat counts have changed
+static void catalogSeatsChanged(const Course* course) {
+    unsigned long seq = __atomic_fetch_add(&catalog_seats_version, 1, __ATOMIC_ACQ_REL);
+    uint64_t entry = (uint64_t)(uint32_t)seq << 32 | (uint32_t)(course - courses);
+    __atomic_store_n(&seat_log[seq & (SEAT_LOG_SIZE - 1)], entry, __ATOMIC_RELEASE);
+}
+
+// Lock manager. The table lock guards the shape of the users and courses
+// arrays and their indexes: requests that insert, remove or rewrite records
+// hold it exclusively, all others share it. ENROLL/UNENROLL only share the
+// table lock: seats are claimed with a compare-and-swap on the course's
+// counter, and a course's roster and waitlist change under its stripe of
+// course_locks, so changes to different courses run in parallel.
+// enrollment_lock covers only the short updates shared by all courses: the
+// enrollment array, its index and free slots, and the students' course lists.
+// A course stripe is always taken before enrollment_lock.
+pthread_rwlock_t table_lock;
+pthread_mutex_t course_locks[COURSE_LOCK_STRIPES];
+pthread_mutex_t enrollment_lock = PTHREAD_MUTEX_INITIALIZER;
+
 // File paths
 const char* USER_FILE = "users.txt";
 const char* COURSE_FILE = "courses.txt";
 const char* ENROLLMENT_FILE = "enrollments.txt";
+const char* WAITLIST_FILE = "waitlists.txt";
+const char* JOURNAL_FILE = "journal.log";
+const char* SNAPSHOT_FILE = "snapshot.bin";
+
+// Binary snapshot, used when the server runs with --snapshot. The file holds
+// the users, courses and enrollments arrays in their in-memory record layout,
+// so at startup it is mapped (privately, copy-on-write) and the arrays point
+// straight into it instead of being parsed. An array moves to the heap the
+// first time it has to grow. A fourth section lists the waitlists as
+// (student, course) pairs in queue order, and a fifth holds the string pool
+// the records refer to. The text files remain the import format, read
+// when there is no usable snapshot, and can be regenerated with --export.
+typedef struct {
+    char magic[8];              // SNAPSHOT_MAGIC
+    uint32_t version;           // SNAPSHOT_VERSION
+    uint32_t byteOrder;         // SNAPSHOT_BYTE_ORDER as stored by the writer
+    uint32_t recordSize[SNAPSHOT_SECTIONS];  // sizeof(User), sizeof(Course), sizeof(Enrollment) twice, 1
+    uint32_t count[SNAPSHOT_SECTIONS];       // users_size, courses_size, enrollments_size, waitlisted, pool bytes
+    uint64_t offset[SNAPSHOT_SECTIONS];      // file offset of each array, 8-byte aligned
+    uint32_t checksum[SNAPSHOT_SECTIONS];    // CRC-32 of each array
+    uint32_t headerChecksum;    // CRC-32 of the header up to this field
+} SnapshotHeader;
+
+int snapshot_mode = 0;
+int export_mode = 0;
+char* snapshot_map = NULL;      // mapping the arrays may still point into
+size_t snapshot_map_size = 0;
+Enrollment* snapshot_waitlists = NULL;  // waitlist section of the loaded snapshot
+int snapshot_waitlists_size = 0;
+
+// Journal (write-ahead log) state, used when the server runs with --journal.
+// Mutations append one record each; the data files above become checkpoints
+// that the journal is replayed on top of at startup.
+int journal_mode = 0;
+int journal_fd = -1;
+pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t journal_flushed = PTHREAD_COND_INITIALIZER;
+char* journal_pending = NULL;           // records appended but not yet written
+size_t journal_pending_len = 0;
+size_t journal_pending_cap = 0;
+char* journal_spare = NULL;             // buffer the next group commit leader swaps in
+size_t journal_spare_cap = 0;
+unsigned long journal_appended = 0;     // sequence number of the last appended record
+unsigned long journal_durable = 0;      // sequence number of the last fsync'd record
+int journal_flushing = 0;               // 1 while a group commit leader is writing
+int journal_records = 0;                // records written since the last checkpoint
+
+// Deferred saves, used unless the server runs with --journal or --bgsave. A
+// mutation only marks the data unsaved; a writer thread rewrites the data
+// files SAVE_DELAY_MS later, so a burst of changes costs one save.
+pthread_mutex_t save_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t save_wakeup = PTHREAD_COND_INITIALIZER;
+int save_pending = 0;                   // changes made since the writer last started a save
+
+// Background saves, used when the server runs with --bgsave. Mutations only
+// count as unsaved changes; a scheduler thread forks, and the child writes
+// the data files from its copy-on-write image of memory while the parent
+// keeps serving.
+int bgsave_mode = 0;
+int bgsave_changes = DEFAULT_BGSAVE_CHANGES;    // save once this many changes are unsaved
+int bgsave_interval = DEFAULT_BGSAVE_INTERVAL;  // or once this many seconds passed with any
+pthread_mutex_t bgsave_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t bgsave_wakeup = PTHREAD_COND_INITIALIZER;
+int bgsave_dirty = 0;                   // changes not yet covered by a finished save
+int bgsave_requested = 0;               // an admin asked for a save (BGSAVE)
+pid_t bgsave_child = 0;                 // pid of the running save, 0 if none
+int bgsave_saves = 0;                   // saves finished since startup
+int bgsave_failures = 0;
+time_t bgsave_last_time = 0;            // when the last save finished
+double bgsave_last_fork_ms = 0;         // time the parent spent in fork()
+double bgsave_last_ms = 0;              // time the child spent writing
+long long bgsave_last_bytes = 0;        // size of the data files it wrote
+
+// What a background save child reports back through its pipe
+typedef struct {
+    double ms;
+    long long bytes;
+} BgsaveResult;
+
+// Event loop (epoll) mode, used when the server runs with --epoll
+int epoll_mode = 0;
+int event_loops = DEFAULT_EVENT_LOOPS;
+
+// Metrics listener (--metrics): a separate port on the loopback interface
+int metrics_port = 0;
+
+// Response being built for a request. Handlers append straight into the
+// connection's output buffer, which works as a per-connection arena: it is
+// kept for the life of the connection and emptied once a response has been
+// written, so a request only allocates when it needs more room than any
+// before it. Each RESPONSE_CHUNK_SIZE bytes are sent on as a partial
+// response, so long listings stream out instead of piling up in memory.
+// Text that is kept elsewhere anyway, like the cached catalog, is not copied
+// in at all but attached (see OutputRef).
+typedef struct Response {
+    struct Connection* conn;    // connection whose output buffer holds the response
+    size_t start;               // offset of the piece being built in the output buffer
+    size_t attached;            // bytes of the piece that are attached, not in the buffer
+    int open;                   // a piece has been started
+} Response;
+
+// Bytes a response sends straight from memory it holds a reference to. They
+// go out after the first at bytes of the output buffer, and release is called
+// once they have been written or dropped.
+typedef struct {
+    size_t at;
+    const char* data;
+    size_t len;
+    void (*release)(void* owner);
+    void* owner;
+} OutputRef;
+
+// Login state of a connection. LOGIN fills it in, and later requests on the
+// connection act as this user without looking it up again. Users are never
+// removed, so their position in the users array stays valid.
+typedef struct {
+    int userId;             // 0 when not logged in
+    int position;           // index of the user in users
+    enum UserType type;
+} Session;
+
+// A command split in place: the verb and its arguments are NUL-terminated
+// inside the request buffer, so parsing copies nothing
+typedef struct {
+    char* verb;
+    char* args[MAX_COMMAND_ARGS];
+    char* text;                 // rest of the request after the arguments, NULL if empty
+} Command;
+
+typedef void (*CommandHandler)(User* user, Command* cmd, Response* res);
+
+// Entry of the command table
+typedef struct {
+    enum UserType role;
+    const char* verb;
+    int arity;                  // words the command needs after its verb
+    int flags;                  // COMMAND_*
+    CommandHandler handler;
+} CommandSpec;
+
+// A change made by an atomic batch, with what undoing it needs: the record
+// as it was before the change, or where an id was taken out of a list
+enum UndoKind {
+    UNDO_USER_ADDED,
+    UNDO_USER_CHANGED,          // user holds the old record
+    UNDO_COURSE_ADDED,
+    UNDO_COURSE_REMOVED,        // course and waitlist hold what was removed
+    UNDO_SEATS,                 // course holds the old seat counts
+    UNDO_ENROLLMENT_ADDED,
+    UNDO_ENROLLMENT_REMOVED,
+    UNDO_WAITLIST_PUSHED,
+    UNDO_WAITLIST_REMOVED
+};
+
+typedef struct {
+    enum UndoKind kind;
+    int position;               // of the user, course or enrollment, or the waitlist's course
+    int reused;                 // added in a free slot rather than appended
+    int studentId, courseId;
+    int at, rosterAt;           // where the ids were in the lists they were taken out of
+    int lastCourseId;
+    User user;
+    Course course;
+    IdQueue waitlist;
+} UndoEntry;
+
+// A BATCH request being executed. While it is active on a thread, changes
+// are collected here and made durable once when the batch ends. An atomic
+// batch holds the table lock exclusively, keeps its journal records until
+// it commits, and logs how to undo each change, so that it can still be
+// rolled back.
+typedef struct {
+    int atomic;
+    int changes;                // records made by the batch so far
+    unsigned long lsn;          // last journal record appended
+    char* records;              // journal records held back (atomic only)
+    size_t records_len;
+    size_t records_cap;
+    UndoEntry* undo;            // changes in the order they were made (atomic only)
+    int undo_count;
+    int undo_cap;
+} Batch;
+
+__thread Batch* active_batch = NULL;
+__thread Batch batch_buffers;   // buffers of the thread's last batch, reused by the next
+
+// A request waiting to be executed by the worker pool, or other work for
+// the auth pool (run)
+typedef struct Job {
+    char* request;
+    Session* session;               // session of the requesting connection
+    Response* response;             // filled in by the worker
+    void (*done)(struct Job* job);  // called on the worker once response is complete
+    void (*run)(struct Job* job);   // work to do instead of a request, NULL for requests
+    void* context;
+    struct Job* next;               // on a queue's overflow list
+} Job;
+
+// Bounded multi-producer multi-consumer queue of jobs (ring buffer). Jobs
+// that must not wait for room wait on the overflow list instead.
+typedef struct {
+    Job** jobs;
+    int capacity;
+    int head;
+    int count;
+    Job* overflow;
+    Job* overflow_tail;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} JobQueue;
+
+// Wire protocol of a connection, decided by the first byte it sends. A framed
+// message starts with a 4-byte big-endian payload length (below
+// MAX_FRAME_SIZE, so its first byte is 0), followed by a 4-byte request id;
+// legacy clients send plain text, and each read is one request. A response
+// frame with FRAME_MORE set in its length is a partial response, continued
+// by the following frames with the same id.
+enum Protocol {
+    PROTOCOL_UNKNOWN = 0,
+    PROTOCOL_LEGACY,
+    PROTOCOL_FRAMED
+};
+
+// State of a client connection
+typedef struct Connection {
+    int fd;
+    enum Protocol protocol;
+    char* in;                   // bytes read from the client
+    size_t in_len;
+    size_t in_cap;
+    char* request;              // current request, NUL-terminated inside in
+    size_t request_size;        // bytes of in taken up by the current request
+    unsigned int request_id;    // id of the current framed request
+    char saved;                 // byte overwritten by the request's terminator
+    char* out;                  // response being built and bytes still being written
+    size_t out_len;
+    size_t out_cap;
+    size_t out_sent;
+    OutputRef* refs;            // attached output still to be written, from refs_head on
+    int refs_head;
+    int refs_count;
+    int refs_cap;
+    size_t ref_sent;            // bytes of refs[refs_head] already written
+    int failed;                 // a write failed; further output is dropped
+    int closing;                // close once the response is written (EXIT)
+    int epfd;                   // event loop that owns the connection
+    Session session;            // user logged in on this connection
+    Response response;          // response to the current request
+    Job job;                    // request handed to the worker pool
+} Connection;
+
+// Requests answered, and the heap allocations made while serving them. Every
+// buffer, list, index, table and cache a request may allocate or grow goes
+// through countedRealloc(); they are all kept and reused, so once they have
+// reached their working size the count stops growing. The working memory
+// libcrypt maps for each password hash is its own and is not counted.
+unsigned long requests_served = 0;
+unsigned long request_allocations = 0;
+
+// realloc() for everything serving a request allocates, counted for MEMORY
+void* countedRealloc(void* ptr, size_t size) {
+    __atomic_fetch_add(&request_allocations, 1, __ATOMIC_RELAXED);
+    return realloc(ptr, size ? size : 1);
+}
+
+// Latency histogram. Bucket i counts durations of less than 2^i
+// microseconds (and at least 2^(i-1)); the last bucket takes all longer ones.
+typedef struct {
+    uint64_t buckets[LATENCY_BUCKETS];
+    uint64_t count;
+    uint64_t total_us;
+} Histogram;
+
+// Statistics recorded by one thread, so that recording never contends on a
+// shared cache line; ADMIN STATS sums them all. When a thread exits its
+// entry is handed on to the next new thread, which keeps adding to it, so
+// the totals stay cumulative without an entry per connection ever served.
+typedef struct ThreadStats {
+    Histogram commands[STAT_KINDS];   // request latency by command (STAT_*)
+    uint64_t rejected;                // requests refused before reaching a handler
+    uint64_t lock_waits;              // table lock acquisitions that had to wait
+    uint64_t lock_wait_us;
+    int owned;                        // in use by a live thread
+    struct ThreadStats* next;
+} ThreadStats;
+
+ThreadStats* thread_stats_list = NULL;
+pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t stats_key;
+pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
+__thread ThreadStats* thread_stats = NULL;
+__thread int request_kind;          // STAT_* slot the current request is counted in
+
+// Shared statistics of rarer events
+Histogram data_write_latency;       // writeDataFiles()
+Histogram journal_sync_latency;     // fdatasync() of a group commit
+int active_connections = 0;
+unsigned long accepted_connections = 0;
+
+static void statAdd(uint64_t* counter, uint64_t n) {
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+static void histogramAdd(Histogram* histogram, uint64_t us) {
+    int bucket = us ? 64 - __builtin_clzll(us) : 0;
+    if (bucket >= LATENCY_BUCKETS) bucket = LATENCY_BUCKETS - 1;
+    statAdd(&histogram->buckets[bucket], 1);
+    statAdd(&histogram->count, 1);
+    statAdd(&histogram->total_us, us);
+}
+
+static uint64_t microsSince(const struct timespec* start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1000000ull + (end.tv_nsec - start->tv_nsec) / 1000;
+}
+
+static void releaseThreadStats(void* stats) {
+    pthread_mutex_lock(&stats_lock);
+    ((ThreadStats*)stats)->owned = 0;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+static void createStatsKey(void) {
+    pthread_key_create(&stats_key, releaseThreadStats);
+}
+
+// The calling thread's statistics, taking over a released entry if there is one
+static ThreadStats* threadStats(void) {
+    if (thread_stats) return thread_stats;
+    pthread_once(&stats_key_once, createStatsKey);
+    pthread_mutex_lock(&stats_lock);
+    ThreadStats* stats = thread_stats_list;
+    while (stats && stats->owned) stats = stats->next;
+    if (!stats) {
+        stats = (ThreadStats*)calloc(1, sizeof(ThreadStats));
+        stats->next = thread_stats_list;
+        thread_stats_list = stats;
+    }
+    stats->owned = 1;
+    pthread_mutex_unlock(&stats_lock);
+    pthread_setspecific(stats_key, stats);
+    thread_stats = stats;
+    return stats;
+}
+
+static void countRejected(void) {
+    statAdd(&threadStats()->rejected, 1);
+}
+
+// Count a table lock acquisition that had to wait since start
+static void countLockWait(const struct timespec* start) {
+    ThreadStats* stats = threadStats();
+    statAdd(&stats->lock_waits, 1);
+    statAdd(&stats->lock_wait_us, microsSince(start));
+}
+
+// Worker pool, used when the server runs with --workers
+int worker_threads = 0;   // 0: requests run on the connection's own thread
+JobQueue work_queue;
+
+// Auth pool: LOGIN and the commands that set a password run on these
+// threads, so password hashing takes a bounded share of the CPU and never
+// queues in front of other requests
+int auth_threads = DEFAULT_AUTH_THREADS;
+JobQueue auth_queue;
 
 // Function prototypes
 void loadData();
 void saveData();
+int writeDataFiles(int durable);
+int importTextFiles();
+int writeTextFiles(int durable);
+int loadSnapshot();
+int writeSnapshot(int durable);
+void* resizeArray(void* array, size_t oldBytes, size_t newBytes);
+void freeArray(void* array);
+void openJournal();
+void replayJournal();
+void applyJournalRecord(char* record);
+unsigned long journalAppend(const char* record);
+void journalSync(unsigned long lsn);
+void journalCheckpoint(int force);
+void* bgsaveScheduler(void* arg);
+int runBackgroundSave(BgsaveResult* result, double* forkMs);
+void markDirty();
+void markUnsaved();
+void* saveWriter(void* arg);
+void requestBackgroundSave(Response* res);
+void writeStats(Response* res);
+void writeMetrics(FILE* out);
+void* metricsServer(void* listen_socket);
+void finishBackgroundSave();
+void persistRecord(const char* record);
+void batchRecord(Batch* batch, const char* record);
+UndoEntry* undoEntry(enum UndoKind kind);
+void undoUser(const User* user);
+void undoSeats(const Course* course, int enrolled);
+void commitBatch(Batch* batch);
+void persistUser(const User* user);
+void persistCourse(const Course* course);
+void persistCourseRemoval(int courseId);
 void* handleClient(void* client_socket);
-char* processRequest(const char* request, int clientSocket);
-char* loginUser(const char* username, const char* password);
-char* handleAdminRequest(const char* request, int userId);
-char* handleStudentRequest(const char* request, int userId);
-char* handleFacultyRequest(const char* request, int userId);
+void freeThreadBuffers();
+void startWorkerPool(int threads);
+void startAuthPool(int threads);
+void submitJob(Job* job);
+void submitJobNoWait(Job* job);
+int isAuthRequest(const char* request, const Session* session);
+void runOnWorkerPool(char* request, Session* session, Response* response);
+void* eventLoop(void* listen_socket);
+void responseAppend(Response* res, const char* data, size_t len);
+void responsePuts(Response* res, const char* text);
+void responsePrintf(Response* res, const char* format, ...);
+void processRequest(const char* request, Session* session, Response* res);
+void loginUser(const char* username, const char* password, Session* session, Response* res);
+int hashPassword(const char* password, char* hash);
+void initCommandTable();
+int commandFlags(enum UserType role, const char* request);
+void dispatchCommand(User* user, char* request, Response* res);
 User* findUserById(int id);
 User* findUserByUsername(const char* username);
 Course* findCourseById(int id);
 Course* findCourseByCode(const char* code);
 int isEnrolled(int studentId, int courseId);
-void acquireReadLock(const char* filename);
-void acquireWriteLock(const char* filename);
-void releaseLock(const char* filename);
+User* addUser(const User* user);
+void reserveUsers(int count);
+User* appendUser(const User* user);
+void renameUser(User* user, const char* username);
+const char* stringAt(StringRef ref);
+StringRef internString(const char* s);
+StringRef internBytes(const char* s, size_t len);
+void rebuildStringIndex();
+Course* addCourse(const Course* course);
+void removeCourseAt(int position);
+void noteTombstone(int tombstones, int slots);
+void compactTables();
+void* compactor(void* arg);
+int reserveSeat(Course* course);
+void releaseSeat(Course* course);
+void indexInsert(HashIndex* index, int position);
+void indexRemove(HashIndex* index, int position);
+void rebuildUserIndexes();
+void rebuildCourseIndexes();
+void rebuildEnrollmentIndexes();
+int findEnrollment(int studentId, int courseId);
+void addEnrollment(int studentId, int courseId);
+int removeEnrollment(int studentId, int courseId);
+void removeCourseEnrollments(int courseId);
+int enrollStudent(int studentId, int courseId);
+void idListAdd(IdList* list, int id);
+int idListRemove(IdList* list, int id);
+void idListInsert(IdList* list, int at, int id);
+void idQueuePush(IdQueue* queue, int id);
+int idQueuePop(IdQueue* queue);
+int idQueueAt(const IdQueue* queue, int i);
+int idQueueRemove(IdQueue* queue, int id);
+void idQueueInsert(IdQueue* queue, int at, int id);
+IdList* coursesOfStudent(int studentId);
+IdList* studentsOfCourse(int courseId);
+IdQueue* waitlistOf(int courseId);
+int waitlistPosition(int studentId, int courseId);
+int joinWaitlist(int studentId, int courseId);
+int leaveWaitlist(int studentId, int courseId);
+int promoteWaitlist(Course* course);
+void loadWaitlists();
+Enrollment* flattenWaitlists(int* count);
+int unenrollStudent(int studentId, int courseId);
+void initLocks();
+void acquireReadLock();
+void acquireWriteLock();
+void releaseLock();
+void lockCourse(int courseId);
+void unlockCourse(int courseId);
+void lockAllCourses();
+void unlockAllCourses();
 char* strdup(const char* s); // For systems lacking strdup
 
-// Signal handler for cleaning up when server is closed
-void signalHandler(int signal_num) {
-    printf("\nSignal %d received. Cleaning up and exiting...\n", signal_num);
-    saveData();
-    sem_destroy(&mutex);
-    free(users);
-    free(courses);
-    free(enrollments);
-    exit(signal_num);
+// Signal handler for cleaning up when server is closed
+void signalHandler(int signal_num) {
+    printf("\nSignal %d received. Cleaning up and exiting...\n", signal_num);
+    if (journal_mode) {
+        journalCheckpoint(1);
+    } else {
+        finishBackgroundSave();
+        saveData();
+    }
+    sem_destroy(&mutex);
+    freeArray(users);
+    freeArray(courses);
+    freeArray(enrollments);
+    freeArray(string_pool);
+    exit(signal_num);
+}
+
+// Load all data, from the snapshot when there is one, else from the text files,
+// and report how long each step of the cold start took.
+void loadData() {
+    struct timespec start, step;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int imported = !snapshot_mode || !loadSnapshot();
+    int threads = 0;
+    if (imported) {
+        threads = importTextFiles();
+    }
+    double readMs = microsSince(&start) / 1000.0;
+
+    clock_gettime(CLOCK_MONOTONIC, &step);
+    rebuildUserIndexes();
+    rebuildCourseIndexes();
+    rebuildEnrollmentIndexes();
+    loadWaitlists();
+    double indexMs = microsSince(&step) / 1000.0;
+    if (snapshot_mode && imported) {
+        writeSnapshot(1);
+    }
+
+    // Replay the journal on top of the last checkpoint
+    clock_gettime(CLOCK_MONOTONIC, &step);
+    if (journal_mode) {
+        replayJournal();
+    }
+    double replayMs = microsSince(&step) / 1000.0;
+
+    char source[64];
+    if (imported) {
+        snprintf(source, sizeof(source), "text files on %d threads", threads);
+    } else {
+        snprintf(source, sizeof(source), "snapshot");
+    }
+    printf("Startup load: %d users, %d courses, %d enrollments in %.1f ms "
+           "(read %.1f ms from %s, indexes %.1f ms, journal %.1f ms)\n",
+           users_size, courses_size, enrollments_size, microsSince(&start) / 1000.0,
+           readMs, source, indexMs, replayMs);
+}
+
+// Text file loader. Each file is mapped and cut into chunks of whole lines;
+// one thread per chunk parses its lines straight into the slice of the
+// record array that starts at the chunk's first line, so the array is
+// allocated once per file. The chunks of all three files are parsed at the
+// same time. Strings cannot be interned from several threads, so the
+// parsers leave each string's offset in the file in its StringRef and the
+// strings are interned afterwards, in file order.
+enum LoadKind { LOAD_USERS, LOAD_COURSES, LOAD_ENROLLMENTS };
+
+typedef struct {
+    enum LoadKind kind;
+    const char* base;       // start of the mapped file, for string offsets
+    const char* start;      // the chunk: whole lines
+    const char* end;
+    char* records;          // slice of the record array for the chunk's lines
+    int lines;
+    int count;              // records parsed (lines that did not parse are skipped)
+} LoadChunk;
+
+typedef struct {
+    const char* path;
+    char* map;
+    size_t size;
+    size_t recordSize;
+    char* records;
+    int count;
+    int chunks;
+} LoadFile;
+
+static int isBlank(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' || c == '\f';
+}
+
+// Parse an int field; returns the position after it, or NULL at the end of
+// the line or if the field is not a number
+static const char* parseIntField(const char* p, const char* end, int* value) {
+    while (p < end && *p != '\n' && isBlank(*p)) p++;
+    int negative = p < end && *p == '-';
+    if (p < end && (*p == '-' || *p == '+')) p++;
+    if (p == end || *p < '0' || *p > '9') return NULL;
+    long n = 0;
+    while (p < end && *p >= '0' && *p <= '9') n = n * 10 + (*p++ - '0');
+    *value = (int)(negative ? -n : n);
+    return p;
+}
+
+// Find a word field; returns the position after it, or NULL at the end of
+// the line
+static const char* parseWordField(const char* p, const char* end, const char** word) {
+    while (p < end && *p != '\n' && isBlank(*p)) p++;
+    if (p == end || *p == '\n') return NULL;
+    *word = p;
+    while (p < end && !isBlank(*p)) p++;
+    return p;
+}
+
+// Parse one line into a record; returns 0 if it is not a valid row
+static int parseRecord(LoadChunk* chunk, const char* p, const char* end, void* record) {
+    const char* word;
+    const char* second;
+    if (chunk->kind == LOAD_USERS) {
+        User* user = (User*)record;
+        int id, active;
+        const char* type;
+        if (!(p = parseIntField(p, end, &id)) || !(p = parseWordField(p, end, &word)) ||
+            !(p = parseWordField(p, end, &second)) || !(p = parseWordField(p, end, &type)) ||
+            !parseIntField(p, end, &active)) {
+            return 0;
+        }
+        const char* typeEnd = type;
+        while (!isBlank(*typeEnd)) typeEnd++;
+        size_t len = typeEnd - type;
+        if (len == 5 && strncmp(type, "ADMIN", 5) == 0) user->type = ADMIN;
+        else if (len == 7 && strncmp(type, "STUDENT", 7) == 0) user->type = STUDENT;
+        else if (len == 7 && strncmp(type, "FACULTY", 7) == 0) user->type = FACULTY;
+        else return 0;
+        user->id = id;
+        user->active = active;
+        user->username = (StringRef)(word - chunk->base);
+        user->password = (StringRef)(second - chunk->base);
+    } else if (chunk->kind == LOAD_COURSES) {
+        Course* course = (Course*)record;
+        if (!(p = parseIntField(p, end, &course->id)) || !(p = parseWordField(p, end, &word)) ||
+            !(p = parseIntField(p, end, &course->facultyId)) ||
+            !(p = parseIntField(p, end, &course->totalSeats)) ||
+            !(p = parseIntField(p, end, &course->enrolledStudents))) {
+            return 0;
+        }
+        while (p < end && *p != '\n' && isBlank(*p)) p++;
+        course->code = (StringRef)(word - chunk->base);
+        course->name = (StringRef)(p - chunk->base);   // rest of the line
+    } else {
+        Enrollment* enrollment = (Enrollment*)record;
+        if (!(p = parseIntField(p, end, &enrollment->studentId)) ||
+            !parseIntField(p, end, &enrollment->courseId)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Loader thread: parse the lines of a chunk
+static void* parseChunk(void* arg) {
+    LoadChunk* chunk = (LoadChunk*)arg;
+    size_t recordSize = chunk->kind == LOAD_USERS ? sizeof(User) :
+                        chunk->kind == LOAD_COURSES ? sizeof(Course) : sizeof(Enrollment);
+    const char* line = chunk->start;
+    while (line < chunk->end) {
+        const char* newline = memchr(line, '\n', chunk->end - line);
+        const char* end = newline ? newline : chunk->end;
+        if (parseRecord(chunk, line, end, chunk->records + chunk->count * recordSize)) chunk->count++;
+        line = end + 1;
+    }
+    return NULL;
+}
+
+// Map a data file and cut it into at most maxChunks chunks of whole lines,
+// counting the lines of each. Returns the number of chunks added.
+static int splitDataFile(LoadFile* file, enum LoadKind kind, int maxChunks, LoadChunk* chunks) {
+    int fd = open(file->path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || st.st_size == 0) {
+        if (fd >= 0) close(fd);
+        return 0;
+    }
+    if ((uint64_t)st.st_size > UINT32_MAX) {
+        fprintf(stderr, "%s is too large to load\n", file->path);
+        exit(EXIT_FAILURE);
+    }
+    file->size = st.st_size;
+    file->map = (char*)mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (file->map == MAP_FAILED) {
+        perror("Failed to map data file");
+        exit(EXIT_FAILURE);
+    }
+    madvise(file->map, file->size, MADV_SEQUENTIAL);
+
+    const char* end = file->map + file->size;
+    size_t target = file->size / maxChunks + 1;
+    if (target < LOADER_CHUNK_BYTES) target = LOADER_CHUNK_BYTES;
+    int lines = 0;
+    int n = 0;
+    for (const char* start = file->map; start < end; n++) {
+        const char* split = end - start > (ptrdiff_t)target ? start + target : end;
+        const char* newline = split < end ? memchr(split, '\n', end - split) : NULL;
+        split = newline ? newline + 1 : end;
+
+        LoadChunk* chunk = &chunks[n];
+        memset(chunk, 0, sizeof(*chunk));
+        chunk->kind = kind;
+        chunk->base = file->map;
+        chunk->start = start;
+        chunk->end = split;
+        for (const char* p = start; p < split; p++) {
+            p = memchr(p, '\n', split - p);
+            chunk->lines++;
+            if (!p) break;
+        }
+        lines += chunk->lines;
+        start = split;
+    }
+
+    file->records = (char*)malloc((lines ? lines : 1) * file->recordSize);
+    char* records = file->records;
+    for (int i = 0; i < n; i++) {
+        chunks[i].records = records;
+        records += chunks[i].lines * file->recordSize;
+    }
+    file->chunks = n;
+    return n;
+}
+
+// Move the records of a file's chunks together and count them
+static void joinChunks(LoadFile* file, LoadChunk* chunks) {
+    file->count = 0;
+    for (int i = 0; i < file->chunks; i++) {
+        memmove(file->records + file->count * file->recordSize, chunks[i].records,
+                chunks[i].count * file->recordSize);
+        file->count += chunks[i].count;
+    }
+}
+
+// Intern a string the parser left as an offset into a mapped file: a word,
+// or with toEndOfLine the rest of the line
+static StringRef internField(const LoadFile* file, StringRef offset, int toEndOfLine) {
+    const char* s = file->map + offset;
+    const char* end = file->map + file->size;
+    const char* p = s;
+    while (p < end && *p != '\n' && (toEndOfLine || !isBlank(*p))) p++;
+    return internBytes(s, p - s);
+}
+
+// Read the users, courses and enrollments text files, parsing their chunks
+// in parallel. Returns the number of loader threads used.
+int importTextFiles() {
+    LoadFile files[3] = {
+        { USER_FILE, NULL, 0, sizeof(User), NULL, 0, 0 },
+        { COURSE_FILE, NULL, 0, sizeof(Course), NULL, 0, 0 },
+        { ENROLLMENT_FILE, NULL, 0, sizeof(Enrollment), NULL, 0, 0 },
+    };
+    int maxChunks = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (maxChunks < 1) maxChunks = 1;
+    if (maxChunks > MAX_LOADER_THREADS) maxChunks = MAX_LOADER_THREADS;
+
+    LoadChunk chunks[3 * MAX_LOADER_THREADS];
+    int total = 0;
+    for (int kind = LOAD_USERS; kind <= LOAD_ENROLLMENTS; kind++) {
+        total += splitDataFile(&files[kind], (enum LoadKind)kind, maxChunks, chunks + total);
+    }
+
+    // The first chunk is parsed on this thread
+    pthread_t threads[3 * MAX_LOADER_THREADS];
+    int started[3 * MAX_LOADER_THREADS] = { 0 };
+    for (int i = 1; i < total; i++) {
+        started[i] = pthread_create(&threads[i], NULL, parseChunk, &chunks[i]) == 0;
+        if (!started[i]) parseChunk(&chunks[i]);
+    }
+    if (total > 0) parseChunk(&chunks[0]);
+    for (int i = 1; i < total; i++) {
+        if (started[i]) pthread_join(threads[i], NULL);
+    }
+
+    LoadChunk* fileChunks = chunks;
+    for (int kind = LOAD_USERS; kind <= LOAD_ENROLLMENTS; kind++) {
+        joinChunks(&files[kind], fileChunks);
+        fileChunks += files[kind].chunks;
+    }
+
+    users = (User*)files[LOAD_USERS].records;
+    users_size = files[LOAD_USERS].count;
+    for (int i = 0; i < users_size; i++) {
+        users[i].username = internField(&files[LOAD_USERS], users[i].username, 0);
+        users[i].password = internField(&files[LOAD_USERS], users[i].password, 0);
+    }
+    courses = (Course*)files[LOAD_COURSES].records;
+    courses_size = files[LOAD_COURSES].count;
+    for (int i = 0; i < courses_size; i++) {
+        courses[i].code = internField(&files[LOAD_COURSES], courses[i].code, 0);
+        courses[i].name = internField(&files[LOAD_COURSES], courses[i].name, 1);
+    }
+    enrollments = (Enrollment*)files[LOAD_ENROLLMENTS].records;
+    enrollments_size = files[LOAD_ENROLLMENTS].count;
+    for (int kind = LOAD_USERS; kind <= LOAD_ENROLLMENTS; kind++) {
+        if (files[kind].map) munmap(files[kind].map, files[kind].size);
+    }
+
+    if (!files[LOAD_USERS].map) {
+        // Create default admin account if file doesn't exist
+        User admin;
+        admin.id = 1;
+        admin.username = internString("admin");
+        char hash[CRYPT_OUTPUT_SIZE];
+        admin.password = internString(hashPassword("admin123", hash) ? hash : "admin123");
+        admin.type = ADMIN;
+        admin.active = 1;
+        users = (User*)realloc(users, (users_size + 1) * sizeof(User));
+        users[users_size++] = admin;
+
+        FILE* file = fopen(USER_FILE, "w");
+        fprintf(file, "%d %s %s ADMIN %d\n", admin.id, stringAt(admin.username),
+                stringAt(admin.password), admin.active);
+        fclose(file);
+    }
+    return total;
+}
+
+// Save all data to files
+void saveData() {
+    sem_wait(&mutex);
+    writeDataFiles(0);
+    sem_post(&mutex);
+}
+
+// Write users, courses and enrollments to the snapshot or the text files.
+// When durable is set the data is fsync'd before returning, as required
+// before truncating the journal. Returns 0 on success, -1 on failure.
+int writeDataFiles(int durable) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int result = snapshot_mode ? writeSnapshot(durable) : writeTextFiles(durable);
+    histogramAdd(&data_write_latency, microsSince(&start));
+    return result;
+}
+
+// Temporary name a data file is written under before being renamed into
+// place. It includes the pid, so a background save child and the server
+// never write the same temporary file.
+static void tempFileName(char* buffer, size_t size, const char* file) {
+    snprintf(buffer, size, "%s.%d.tmp", file, (int)getpid());
+}
+
+// Flush and close a data file written under its temporary name, then rename
+// it into place
+static int finishDataFile(FILE* file, const char* temp, const char* target, int durable) {
+    int failed = fflush(file) != 0 || (durable && fsync(fileno(file)) < 0);
+    failed = fclose(file) != 0 || failed;
+    if (failed || rename(temp, target) < 0) {
+        perror("Failed to write data file");
+        unlink(temp);
+        return -1;
+    }
+    return 0;
+}
+
+// Write users, courses and enrollments to their text files. Each file is
+// replaced atomically, so a reader never sees one half written.
+int writeTextFiles(int durable) {
+    char temp[MAX_STR];
+    int failed = 0;
+
+    // Save users
+    tempFileName(temp, sizeof(temp), USER_FILE);
+    FILE* userFile = fopen(temp, "w");
+    if (!userFile) {
+        perror("Failed to write data file");
+        return -1;
+    }
+    for (int i = 0; i < users_size; i++) {
+        const char* userType = users[i].type == ADMIN ? "ADMIN" : 
+                             users[i].type == STUDENT ? "STUDENT" : "FACULTY";
+        fprintf(userFile, "%d %s %s %s %d\n", users[i].id, stringAt(users[i].username), 
+                stringAt(users[i].password), userType, users[i].active);
+    }
+    failed |= finishDataFile(userFile, temp, USER_FILE, durable);
+
+    // Save courses
+    tempFileName(temp, sizeof(temp), COURSE_FILE);
+    FILE* courseFile = fopen(temp, "w");
+    if (!courseFile) {
+        perror("Failed to write data file");
+        return -1;
+    }
+    for (int i = 0; i < courses_size; i++) {
+        if (!courses[i].id) continue;
+        fprintf(courseFile, "%d %s %d %d %d %s\n", courses[i].id, stringAt(courses[i].code), 
+                courses[i].facultyId, courses[i].totalSeats, courses[i].enrolledStudents, 
+                stringAt(courses[i].name));
+    }
+    failed |= finishDataFile(courseFile, temp, COURSE_FILE, durable);
+
+    // Save enrollments
+    tempFileName(temp, sizeof(temp), ENROLLMENT_FILE);
+    FILE* enrollmentFile = fopen(temp, "w");
+    if (!enrollmentFile) {
+        perror("Failed to write data file");
+        return -1;
+    }
+    pthread_mutex_lock(&enrollment_lock);
+    for (int i = 0; i < enrollments_size; i++) {
+        if (!enrollments[i].studentId) continue;
+        fprintf(enrollmentFile, "%d %d\n", enrollments[i].studentId, enrollments[i].courseId);
+    }
+    pthread_mutex_unlock(&enrollment_lock);
+    failed |= finishDataFile(enrollmentFile, temp, ENROLLMENT_FILE, durable);
+
+    // Save waitlists, each course's in queue order
+    tempFileName(temp, sizeof(temp), WAITLIST_FILE);
+    FILE* waitlistFile = fopen(temp, "w");
+    if (!waitlistFile) {
+        perror("Failed to write data file");
+        return -1;
+    }
+    int waiting;
+    Enrollment* waitlisted = flattenWaitlists(&waiting);
+    for (int i = 0; i < waiting; i++) {
+        fprintf(waitlistFile, "%d %d\n", waitlisted[i].studentId, waitlisted[i].courseId);
+    }
+    failed |= finishDataFile(waitlistFile, temp, WAITLIST_FILE, durable);
+
+    return failed ? -1 : 0;
+}
+
+// CRC-32 (IEEE) of a buffer, continuing from crc (0 to start)
+static uint32_t crc32Update(uint32_t crc, const void* data, size_t len) {
+    static uint32_t table[256];
+    static int ready = 0;
+    if (!ready) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+        ready = 1;
+    }
+    const unsigned char* p = (const unsigned char*)data;
+    crc = ~crc;
+    while (len--) crc = table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+// Write all of a buffer to a file descriptor
+static int writeAll(int fd, const void* data, size_t len) {
+    const char* p = (const char*)data;
+    while (len > 0) {
+        ssize_t written = write(fd, p, len);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += written;
+        len -= written;
+    }
+    return 0;
+}
+
+// Write one array of the snapshot through a bounce buffer, so the checksum
+// covers exactly the bytes written even while seat counters keep changing.
+// The array is padded to the next 8-byte boundary.
+static int writeSnapshotSection(int fd, const void* data, size_t len, uint32_t* checksum) {
+    static const char zeros[8] = { 0 };
+    char buffer[65536];
+    const char* p = (const char*)data;
+    *checksum = 0;
+    while (len > 0) {
+        size_t chunk = len < sizeof(buffer) ? len : sizeof(buffer);
+        memcpy(buffer, p, chunk);
+        *checksum = crc32Update(*checksum, buffer, chunk);
+        if (writeAll(fd, buffer, chunk) < 0) return -1;
+        p += chunk;
+        len -= chunk;
+    }
+    off_t position = lseek(fd, 0, SEEK_CUR);
+    if (position % 8 && writeAll(fd, zeros, 8 - position % 8) < 0) return -1;
+    return 0;
+}
+
+// Write a new snapshot next to the current one and rename it into place, so
+// a crash leaves either the old or the new snapshot, and the file the arrays
+// may be mapped from is never modified
+int writeSnapshot(int durable) {
+    char temp[MAX_STR];
+    tempFileName(temp, sizeof(temp), SNAPSHOT_FILE);
+    int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("Failed to write snapshot");
+        return -1;
+    }
+
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.byteOrder = SNAPSHOT_BYTE_ORDER;
+    header.recordSize[0] = sizeof(User);
+    header.recordSize[1] = sizeof(Course);
+    header.recordSize[2] = sizeof(Enrollment);
+    header.recordSize[3] = sizeof(Enrollment);
+    header.recordSize[4] = 1;
+
+    // Arrays first, then the header with their counts and checksums
+    int failed = writeAll(fd, &header, sizeof(header)) < 0;
+    header.offset[0] = sizeof(header);
+    header.count[0] = users_size;
+    failed = failed || writeSnapshotSection(fd, users, users_size * sizeof(User), &header.checksum[0]) < 0;
+    header.offset[1] = lseek(fd, 0, SEEK_CUR);
+    header.count[1] = courses_size;
+    failed = failed || writeSnapshotSection(fd, courses, courses_size * sizeof(Course), &header.checksum[1]) < 0;
+    header.offset[2] = lseek(fd, 0, SEEK_CUR);
+    pthread_mutex_lock(&enrollment_lock);
+    header.count[2] = enrollments_size;
+    failed = failed || writeSnapshotSection(fd, enrollments, enrollments_size * sizeof(Enrollment), &header.checksum[2]) < 0;
+    pthread_mutex_unlock(&enrollment_lock);
+    header.offset[3] = lseek(fd, 0, SEEK_CUR);
+    int waiting;
+    Enrollment* waitlisted = flattenWaitlists(&waiting);
+    header.count[3] = waiting;
+    failed = failed || writeSnapshotSection(fd, waitlisted, waiting * sizeof(Enrollment), &header.checksum[3]) < 0;
+    header.offset[4] = lseek(fd, 0, SEEK_CUR);
+    header.count[4] = string_pool_len;
+    failed = failed || writeSnapshotSection(fd, string_pool, string_pool_len, &header.checksum[4]) < 0;
+    header.headerChecksum = crc32Update(0, &header, offsetof(SnapshotHeader, headerChecksum));
+    failed = failed || pwrite(fd, &header, sizeof(header), 0) != sizeof(header);
+
+    if (durable && !failed) failed = fsync(fd) < 0;
+    close(fd);
+    if (failed || rename(temp, SNAPSHOT_FILE) < 0) {
+        perror("Failed to write snapshot");
+        unlink(temp);
+        return -1;
+    }
+    return 0;
+}
+
+// Map the snapshot and point the data arrays into it. Returns 0 if there is
+// no snapshot or it is unusable (truncated, corrupt, or written by a build
+// with a different record layout), in which case nothing is changed.
+int loadSnapshot() {
+    int fd = open(SNAPSHOT_FILE, O_RDONLY);
+    if (fd < 0) return 0;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(SnapshotHeader)) {
+        close(fd);
+        printf("Ignoring snapshot %s: truncated\n", SNAPSHOT_FILE);
+        return 0;
+    }
+    size_t size = st.st_size;
+    char* map = (char*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("Failed to map snapshot");
+        return 0;
+    }
+
+    SnapshotHeader* header = (SnapshotHeader*)map;
+    const uint32_t recordSize[SNAPSHOT_SECTIONS] = { sizeof(User), sizeof(Course), sizeof(Enrollment), sizeof(Enrollment), 1 };
+    const char* problem = NULL;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0) {
+        problem = "not a snapshot";
+    } else if (header->version != SNAPSHOT_VERSION || header->byteOrder != SNAPSHOT_BYTE_ORDER) {
+        problem = "unsupported version or byte order";
+    } else if (header->headerChecksum != crc32Update(0, header, offsetof(SnapshotHeader, headerChecksum))) {
+        problem = "header checksum mismatch";
+    }
+    for (int i = 0; i < SNAPSHOT_SECTIONS && !problem; i++) {
+        uint64_t bytes = (uint64_t)header->count[i] * header->recordSize[i];
+        if (header->recordSize[i] != recordSize[i] || header->count[i] > INT32_MAX) {
+            problem = "record layout differs from this build";
+        } else if (header->offset[i] % 8 || header->offset[i] > size || bytes > size - header->offset[i]) {
+            problem = "truncated";
+        } else if (crc32Update(0, map + header->offset[i], bytes) != header->checksum[i]) {
+            problem = "checksum mismatch";
+        }
+    }
+    if (!problem && header->count[4] && map[header->offset[4] + header->count[4] - 1] != '\0') {
+        problem = "string pool is not terminated";
+    }
+    if (problem) {
+        printf("Ignoring snapshot %s: %s\n", SNAPSHOT_FILE, problem);
+        munmap(map, size);
+        return 0;
+    }
+
+    snapshot_map = map;
+    snapshot_map_size = size;
+    users_size = header->count[0];
+    users = users_size ? (User*)(map + header->offset[0]) : NULL;
+    courses_size = header->count[1];
+    courses = courses_size ? (Course*)(map + header->offset[1]) : NULL;
+    enrollments_size = header->count[2];
+    enrollments = enrollments_size ? (Enrollment*)(map + header->offset[2]) : NULL;
+    snapshot_waitlists_size = header->count[3];
+    snapshot_waitlists = (Enrollment*)(map + header->offset[3]);
+    string_pool_len = string_pool_cap = header->count[4];
+    string_pool = string_pool_len ? map + header->offset[4] : NULL;
+    rebuildStringIndex();
+    printf("Loaded snapshot %s (%d users, %d courses, %d enrollments)\n", SNAPSHOT_FILE,
+           users_size, courses_size, enrollments_size);
+    return 1;
+}
+
+// Whether a data array still points into the snapshot mapping
+static int isMapped(const void* array) {
+    return snapshot_map && (const char*)array >= snapshot_map &&
+           (const char*)array < snapshot_map + snapshot_map_size;
+}
+
+// realloc() for the data arrays; an array still in the snapshot mapping is
+// copied to the heap the first time it is resized
+void* resizeArray(void* array, size_t oldBytes, size_t newBytes) {
+    if (!isMapped(array)) return countedRealloc(array, newBytes);
+    void* copy = countedRealloc(NULL, newBytes);
+    memcpy(copy, array, oldBytes < newBytes ? oldBytes : newBytes);
+    return copy;
+}
+
+// free() for the data arrays
+void freeArray(void* array) {
+    if (!isMapped(array)) free(array);
+}
+
+// Open the journal for appending
+void openJournal() {
+    journal_fd = open(JOURNAL_FILE, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (journal_fd < 0) {
+        perror("Failed to open journal");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Apply every complete record in the journal to the in-memory data.
+// A torn last record (no trailing newline) from a crash mid-write is ignored.
+void replayJournal() {
+    FILE* file = fopen(JOURNAL_FILE, "r");
+    if (!file) return;
+
+    char line[1024];
+    int replayed = 0;
+    while (fgets(line, sizeof(line), file)) {
+        size_t len = strlen(line);
+        if (len == 0 || line[len-1] != '\n') break;
+        line[len-1] = '\0';
+        applyJournalRecord(line);
+        replayed++;
+    }
+    fclose(file);
+
+    if (replayed > 0) {
+        printf("Replayed %d journal records\n", replayed);
+    }
+}
+
+// Apply a single journal record. Records are idempotent (upserts, and enroll/
+// unenroll only change state when needed), so a record that is already
+// reflected in the checkpoint can safely be applied again.
+void applyJournalRecord(char* record) {
+    char op = record[0];
+    char* args = record[0] ? record + 1 : record;
+
+    if (op == 'U') {
+        User user;
+        char username[MAX_STR], password[MAX_STR];
+        char userType[20];
+        int active;
+        if (sscanf(args, "%d %255s %255s %19s %d", &user.id, username, password,
+                   userType, &active) != 5) return;
+        user.username = internString(username);
+        user.password = internString(password);
+        user.active = active;
+        if (strcmp(userType, "ADMIN") == 0) user.type = ADMIN;
+        else if (strcmp(userType, "STUDENT") == 0) user.type = STUDENT;
+        else user.type = FACULTY;
+
+        User* existing = findUserById(user.id);
+        if (existing) {
+            renameUser(existing, username);
+            *existing = user;
+        } else {
+            addUser(&user);
+        }
+    }
+    else if (op == 'C') {
+        Course course;
+        char code[MAX_STR];
+        char temp[1024];
+        if (sscanf(args, "%d %255s %d %d %d %[^\n]", &course.id, code, &course.facultyId,
+                   &course.totalSeats, &course.enrolledStudents, temp) < 6) return;
+        course.code = internString(code);
+        course.name = internString(temp);
+
+        Course* existing = findCourseById(course.id);
+        if (existing) {
+            int position = existing - courses;
+            indexRemove(&courseCodeIndex, position);
+            *existing = course;
+            indexInsert(&courseCodeIndex, position);
+        } else {
+            addCourse(&course);
+        }
+    }
+    else if (op == 'R') {
+        int courseId;
+        if (sscanf(args, "%d", &courseId) != 1) return;
+        Course* course = findCourseById(courseId);
+        if (course) {
+            removeCourseEnrollments(courseId);
+            removeCourseAt(course - courses);
+        }
+    }
+    else if (op == 'E') {
+        int studentId, courseId;
+        if (sscanf(args, "%d %d", &studentId, &courseId) != 2) return;
+        if (isEnrolled(studentId, courseId)) return;
+        addEnrollment(studentId, courseId);
+        Course* course = findCourseById(courseId);
+        if (course) course->enrolledStudents++;
+    }
+    else if (op == 'X') {
+        int studentId, courseId;
+        if (sscanf(args, "%d %d", &studentId, &courseId) != 2) return;
+        if (removeEnrollment(studentId, courseId)) {
+            Course* course = findCourseById(courseId);
+            if (course) course->enrolledStudents--;
+        }
+    }
+    else if (op == 'W' || op == 'L' || op == 'P') {
+        int studentId, courseId;
+        if (sscanf(args, "%d %d", &studentId, &courseId) != 2) return;
+        IdQueue* waitlist = waitlistOf(courseId);
+        if (!waitlist) return;
+        if (op == 'W') {
+            if (!waitlistPosition(studentId, courseId)) idQueuePush(waitlist, studentId);
+        } else {
+            idQueueRemove(waitlist, studentId);
+        }
+        // A promotion also enrolls the student
+        if (op == 'P' && !isEnrolled(studentId, courseId)) {
+            addEnrollment(studentId, courseId);
+            findCourseById(courseId)->enrolledStudents++;
+        }
+    }
+}
+
+// Append a record to the in-memory journal buffer and return its sequence number.
+// The record is not durable until journalSync() has returned for that number.
+unsigned long journalAppend(const char* record) {
+    size_t len = strlen(record);
+
+    pthread_mutex_lock(&journal_lock);
+    if (journal_pending_len + len + 1 > journal_pending_cap) {
+        size_t cap = journal_pending_cap ? journal_pending_cap * 2 : 4096;
+        while (cap < journal_pending_len + len + 1) cap *= 2;
+        journal_pending = (char*)countedRealloc(journal_pending, cap);
+        journal_pending_cap = cap;
+    }
+    memcpy(journal_pending + journal_pending_len, record, len);
+    journal_pending[journal_pending_len + len] = '\n';
+    journal_pending_len += len + 1;
+    unsigned long lsn = ++journal_appended;
+    pthread_mutex_unlock(&journal_lock);
+
+    return lsn;
+}
+
+// Write a buffer to the journal, retrying on short writes
+static void journalWrite(const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(journal_fd, data, len);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            perror("Journal write failed");
+            return;
+        }
+        data += written;
+        len -= written;
+    }
+}
+
+// Wait until the record with the given sequence number is on disk (group commit).
+// The first waiter becomes the leader and writes + fsyncs everything appended so
+// far in one go; threads that appended meanwhile wait for it instead of issuing
+// their own fsync, so N concurrent commits cost a single fsync.
+void journalSync(unsigned long lsn) {
+    int checkpoint = 0;
+
+    pthread_mutex_lock(&journal_lock);
+    while (journal_durable < lsn) {
+        if (journal_flushing) {
+            pthread_cond_wait(&journal_flushed, &journal_lock);
+            continue;
+        }
+
+        // Become the leader: swap in the spare buffer and flush the pending
+        // one without the lock
+        journal_flushing = 1;
+        char* batch = journal_pending;
+        size_t batch_len = journal_pending_len;
+        size_t batch_cap = journal_pending_cap;
+        unsigned long target = journal_appended;
+        journal_pending = journal_spare;
+        journal_pending_len = 0;
+        journal_pending_cap = journal_spare_cap;
+        pthread_mutex_unlock(&journal_lock);
+
+        journalWrite(batch, batch_len);
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        fdatasync(journal_fd);
+        histogramAdd(&journal_sync_latency, microsSince(&start));
+
+        pthread_mutex_lock(&journal_lock);
+        journal_spare = batch;
+        journal_spare_cap = batch_cap;
+        journal_records += (int)(target - journal_durable);
+        journal_durable = target;
+        journal_flushing = 0;
+        if (journal_records >= JOURNAL_CHECKPOINT_RECORDS) checkpoint = 1;
+        pthread_cond_broadcast(&journal_flushed);
+    }
+    pthread_mutex_unlock(&journal_lock);
+
+    if (checkpoint) {
+        journalCheckpoint(0);
+    }
+}
+
+// Rewrite the data files from memory and truncate the journal. Unless force is
+// set this only happens once the checkpoint threshold is reached. The
+// checkpoint takes the leader's place, so nothing is written to the journal
+// meanwhile, but it does not hold the journal lock while writing: appends
+// made under the course locks go on into the pending buffer and are written
+// after the truncation. Replaying one whose change the data files already
+// contain is harmless.
+void journalCheckpoint(int force) {
+    pthread_mutex_lock(&journal_lock);
+    while (journal_flushing) {
+        pthread_cond_wait(&journal_flushed, &journal_lock);
+    }
+    if (!force && journal_records < JOURNAL_CHECKPOINT_RECORDS) {
+        // Another thread checkpointed first
+        pthread_mutex_unlock(&journal_lock);
+        return;
+    }
+    journal_flushing = 1;
+    pthread_mutex_unlock(&journal_lock);
+
+    sem_wait(&mutex);
+    writeDataFiles(1);
+    sem_post(&mutex);
+
+    pthread_mutex_lock(&journal_lock);
+    if (journal_fd >= 0 && ftruncate(journal_fd, 0) < 0) {
+        perror("Journal truncate failed");
+    }
+    journal_records = 0;
+    journal_flushing = 0;
+    pthread_cond_broadcast(&journal_flushed);
+    pthread_mutex_unlock(&journal_lock);
+}
+
+// Milliseconds elapsed since start
+static double elapsedMs(const struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+// Total size of the data files, as last written
+static long long dataFilesSize() {
+    const char* files[] = { USER_FILE, COURSE_FILE, ENROLLMENT_FILE, WAITLIST_FILE };
+    struct stat st;
+    if (snapshot_mode) {
+        return stat(SNAPSHOT_FILE, &st) == 0 ? (long long)st.st_size : 0;
+    }
+    long long total = 0;
+    for (int i = 0; i < 4; i++) {
+        if (stat(files[i], &st) == 0) total += st.st_size;
+    }
+    return total;
+}
+
+// Start background saves when enough changes have piled up, when the
+// interval has passed with any unsaved change, or when an admin asks. Only
+// one save runs at a time; this thread waits for it.
+void* bgsaveScheduler(void* arg) {
+    time_t lastSave = time(NULL);
+    time_t retryAt = 0;         // after a failure, wait until then
+
+    pthread_mutex_lock(&bgsave_lock);
+    for (;;) {
+        time_t now = time(NULL);
+        int due = bgsave_dirty > 0 && now >= retryAt &&
+                  (bgsave_dirty >= bgsave_changes || now >= lastSave + bgsave_interval);
+        if (!bgsave_requested && !due) {
+            if (bgsave_dirty == 0) {
+                pthread_cond_wait(&bgsave_wakeup, &bgsave_lock);
+            } else {
+                time_t wake = lastSave + bgsave_interval;
+                if (bgsave_dirty >= bgsave_changes || wake < retryAt) wake = retryAt;
+                struct timespec deadline = { wake, 0 };
+                pthread_cond_timedwait(&bgsave_wakeup, &bgsave_lock, &deadline);
+            }
+            continue;
+        }
+
+        int changes = bgsave_dirty;
+        bgsave_requested = 0;
+        pthread_mutex_unlock(&bgsave_lock);
+
+        BgsaveResult result;
+        double forkMs = 0;
+        int ok = runBackgroundSave(&result, &forkMs) == 0;
+
+        pthread_mutex_lock(&bgsave_lock);
+        lastSave = time(NULL);
+        bgsave_last_fork_ms = forkMs;
+        if (ok) {
+            bgsave_dirty -= changes;
+            bgsave_saves++;
+            bgsave_last_time = lastSave;
+            bgsave_last_ms = result.ms;
+            bgsave_last_bytes = result.bytes;
+            retryAt = 0;
+            // The child's own statistics die with it
+            histogramAdd(&data_write_latency, (uint64_t)(result.ms * 1000));
+            printf("Background save: %lld bytes in %.1f ms (fork %.1f ms)\n",
+                   result.bytes, result.ms, forkMs);
+        } else {
+            bgsave_failures++;
+            retryAt = lastSave + bgsave_interval;
+            printf("Background save failed, retrying in %d s\n", bgsave_interval);
+        }
+    }
+    return NULL;
+}
+
+// Fork a child that writes the data files and wait for it. The fork happens
+// with the tables held exclusively, so the child's copy is a consistent point
+// in time; the parent releases them as soon as fork() returns. Returns 0 if
+// the child wrote everything.
+int runBackgroundSave(BgsaveResult* result, double* forkMs) {
+    int fds[2];
+    if (pipe(fds) < 0) {
+        perror("Background save pipe failed");
+        return -1;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    acquireWriteLock();
+    lockAllCourses();
+    pthread_mutex_lock(&enrollment_lock);
+    pid_t pid = fork();
+    if (pid == 0) {
+        // The child only has this thread, which owns the locks it inherited.
+        // It ignores Ctrl+C so the parent can wait for it before its final save.
+        signal(SIGINT, SIG_IGN);
+        pthread_mutex_unlock(&enrollment_lock);
+        unlockAllCourses();
+        close(fds[0]);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (writeDataFiles(1) < 0) _exit(1);
+        BgsaveResult report = { elapsedMs(&start), dataFilesSize() };
+        _exit(write(fds[1], &report, sizeof(report)) == sizeof(report) ? 0 : 1);
+    }
+    pthread_mutex_unlock(&enrollment_lock);
+    unlockAllCourses();
+    releaseLock();
+    *forkMs = elapsedMs(&start);
+    close(fds[1]);
+    if (pid < 0) {
+        perror("Background save fork failed");
+        close(fds[0]);
+        return -1;
+    }
+
+    pthread_mutex_lock(&bgsave_lock);
+    bgsave_child = pid;
+    pthread_mutex_unlock(&bgsave_lock);
+
+    ssize_t got;
+    while ((got = read(fds[0], result, sizeof(*result))) < 0 && errno == EINTR) {}
+    close(fds[0]);
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+
+    pthread_mutex_lock(&bgsave_lock);
+    bgsave_child = 0;
+    pthread_mutex_unlock(&bgsave_lock);
+    return got == sizeof(*result) && WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+// Count a change that the next background save has to pick up
+void markDirty() {
+    pthread_mutex_lock(&bgsave_lock);
+    bgsave_dirty++;
+    if (bgsave_dirty == 1 || bgsave_dirty == bgsave_changes) {
+        pthread_cond_signal(&bgsave_wakeup);
+    }
+    pthread_mutex_unlock(&bgsave_lock);
+}
+
+// Have the data files rewritten by the deferred save
+void markUnsaved() {
+    pthread_mutex_lock(&save_lock);
+    if (save_pending++ == 0) pthread_cond_signal(&save_wakeup);
+    pthread_mutex_unlock(&save_lock);
+}
+
+// Deferred save writer: once a change is made, wait SAVE_DELAY_MS for the
+// rest of its burst, then rewrite the data files under the shared table
+// lock. Changes made while it writes are picked up by the next save.
+void* saveWriter(void* arg) {
+    pthread_mutex_lock(&save_lock);
+    for (;;) {
+        while (!save_pending) {
+            pthread_cond_wait(&save_wakeup, &save_lock);
+        }
+        pthread_mutex_unlock(&save_lock);
+        usleep(SAVE_DELAY_MS * 1000);
+
+        pthread_mutex_lock(&save_lock);
+        save_pending = 0;
+        pthread_mutex_unlock(&save_lock);
+        acquireReadLock();
+        saveData();
+        releaseLock();
+        pthread_mutex_lock(&save_lock);
+    }
+    return NULL;
+}
+
+// ADMIN BGSAVE: start a background save now and report the last one
+void requestBackgroundSave(Response* res) {
+    if (!bgsave_mode) {
+        responsePuts(res, "Background saves are not enabled (start the server with --bgsave)");
+        return;
+    }
+    pthread_mutex_lock(&bgsave_lock);
+    if (bgsave_child || bgsave_requested) {
+        responsePuts(res, "Background save already in progress\n");
+    } else {
+        bgsave_requested = 1;
+        pthread_cond_signal(&bgsave_wakeup);
+        responsePuts(res, "Background save started\n");
+    }
+    if (bgsave_saves > 0) {
+        responsePrintf(res, "Last save: %lld bytes in %.1f ms (fork %.1f ms), %ld s ago\n",
+                       bgsave_last_bytes, bgsave_last_ms, bgsave_last_fork_ms,
+                       (long)(time(NULL) - bgsave_last_time));
+    }
+    responsePrintf(res, "Saves: %d, failed: %d, unsaved changes: %d",
+                   bgsave_saves, bgsave_failures, bgsave_dirty);
+    pthread_mutex_unlock(&bgsave_lock);
+}
+
+// Wait for a running background save to finish, so that a save made after
+// this is not overwritten by an older one
+void finishBackgroundSave() {
+    pthread_mutex_lock(&bgsave_lock);
+    pid_t pid = bgsave_child;
+    pthread_mutex_unlock(&bgsave_lock);
+    if (pid > 0) {
+        printf("Waiting for background save (pid %d)\n", (int)pid);
+        waitpid(pid, NULL, 0);
+    }
+}
+
+// Make a mutation durable: append a record in journal mode, leave it to the
+// next background save in bgsave mode, otherwise to the deferred save.
+// Inside a batch this is deferred to commitBatch().
+void persistRecord(const char* record) {
+    if (active_batch) {
+        batchRecord(active_batch, record);
+    } else if (journal_mode) {
+        journalSync(journalAppend(record));
+    } else if (bgsave_mode) {
+        markDirty();
+    } else {
+        markUnsaved();
+    }
+}
+
+// Note a change made inside a batch. In journal mode the record is appended
+// right away, so it keeps its place relative to other connections' records;
+// an atomic batch excludes everyone else and holds it back instead.
+void batchRecord(Batch* batch, const char* record) {
+    batch->changes++;
+    if (!journal_mode) return;
+    if (!batch->atomic) {
+        batch->lsn = journalAppend(record);
+        return;
+    }
+    size_t len = strlen(record);
+    if (batch->records_len + len + 1 > batch->records_cap) {
+        batch->records_cap = (batch->records_len + len + 1) * 2;
+        batch->records = (char*)countedRealloc(batch->records, batch->records_cap);
+    }
+    memcpy(batch->records + batch->records_len, record, len + 1);
+    batch->records_len += len + 1;
+}
+
+// Log a change about to be made by the running atomic batch; returns NULL
+// when no atomic batch runs on this thread
+UndoEntry* undoEntry(enum UndoKind kind) {
+    Batch* batch = active_batch;
+    if (!batch || !batch->atomic) return NULL;
+    if (batch->undo_count == batch->undo_cap) {
+        batch->undo_cap = batch->undo_cap ? batch->undo_cap * 2 : 16;
+        batch->undo = (UndoEntry*)countedRealloc(batch->undo, batch->undo_cap * sizeof(UndoEntry));
+    }
+    UndoEntry* entry = &batch->undo[batch->undo_count++];
+    memset(entry, 0, sizeof(*entry));
+    entry->kind = kind;
+    return entry;
+}
+
+// Log a user record before the running atomic batch changes it
+void undoUser(const User* user) {
+    UndoEntry* entry = undoEntry(UNDO_USER_CHANGED);
+    if (!entry) return;
+    entry->position = user - users;
+    entry->user = *user;
+}
+
+// Log a course's seat counts, with enrolled students before the change,
+// before the running atomic batch changes them
+void undoSeats(const Course* course, int enrolled) {
+    UndoEntry* entry = undoEntry(UNDO_SEATS);
+    if (!entry) return;
+    entry->position = course - courses;
+    entry->course = *course;
+    entry->course.enrolledStudents = enrolled;
+}
+
+// Make a batch's changes durable with a single journal sync or save
+void commitBatch(Batch* batch) {
+    if (batch->changes == 0) return;
+    if (journal_mode) {
+        for (size_t at = 0; at < batch->records_len; at += strlen(batch->records + at) + 1) {
+            batch->lsn = journalAppend(batch->records + at);
+        }
+        journalSync(batch->lsn);
+    } else if (bgsave_mode) {
+        for (int i = 0; i < batch->changes; i++) markDirty();
+    } else {
+        markUnsaved();
+    }
+}
+
+void persistUser(const User* user) {
+    char record[BUFFER_SIZE];
+    const char* userType = user->type == ADMIN ? "ADMIN" : 
+                         user->type == STUDENT ? "STUDENT" : "FACULTY";
+    snprintf(record, sizeof(record), "U %d %s %s %s %d", user->id, stringAt(user->username),
+             stringAt(user->password), userType, user->active);
+    persistRecord(record);
+}
+
+void persistCourse(const Course* course) {
+    char record[BUFFER_SIZE];
+    snprintf(record, sizeof(record), "C %d %s %d %d %d %s", course->id, stringAt(course->code),
+             course->facultyId, course->totalSeats, course->enrolledStudents, stringAt(course->name));
+    persistRecord(record);
+}
+
+void persistCourseRemoval(int courseId) {
+    char record[32];
+    snprintf(record, sizeof(record), "R %d", courseId);
+    persistRecord(record);
+}
+
+// Take the next job, waiting while the queue is empty
+static Job* jobQueuePop(JobQueue* queue) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0) {
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+    }
+    Job* job = queue->jobs[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+    if (queue->overflow) {
+        // The freed slot goes to the oldest parked job
+        Job* parked = queue->overflow;
+        queue->overflow = parked->next;
+        if (!queue->overflow) queue->overflow_tail = NULL;
+        queue->jobs[(queue->head + queue->count) % queue->capacity] = parked;
+        queue->count++;
+    } else {
+        pthread_cond_signal(&queue->not_full);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return job;
+}
+
+__thread JobQueue* pool_queue = NULL;  // queue of the pool the thread belongs to
+
+// Pool thread: execute the requests queued on its queue
+static void* workerThread(void* arg) {
+    JobQueue* queue = (JobQueue*)arg;
+    pool_queue = queue;
+    while (1) {
+        Job* job = jobQueuePop(queue);
+        if (job->run) {
+            job->run(job);
+        } else {
+            processRequest(job->request, job->session, job->response);
+        }
+        if (job->done) job->done(job);
+    }
+    return NULL;
+}
+
+// Start a fixed number of threads and the bounded queue feeding them
+static void startPool(JobQueue* queue, int threads) {
+    queue->jobs = (Job**)malloc(WORK_QUEUE_SIZE * sizeof(Job*));
+    queue->capacity = WORK_QUEUE_SIZE;
+    queue->head = 0;
+    queue->count = 0;
+    queue->overflow = NULL;
+    queue->overflow_tail = NULL;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    pthread_cond_init(&queue->not_full, NULL);
+
+    for (int i = 0; i < threads; i++) {
+        pthread_t thread_id;
+        if (pthread_create(&thread_id, NULL, workerThread, queue) != 0) {
+            perror("Thread creation failed");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(thread_id);
+    }
+}
+
+void startWorkerPool(int threads) {
+    startPool(&work_queue, threads);
+}
+
+void startAuthPool(int threads) {
+    startPool(&auth_queue, threads);
+}
+
+// Queue of the pool a job runs on: the auth pool if it hashes passwords
+// (see hashPreparedPasswords()) or its request does, otherwise the worker pool
+static JobQueue* jobQueueFor(Job* job) {
+    return job->run || isAuthRequest(job->request, job->session) ? &auth_queue : &work_queue;
+}
+
+static void jobQueuePush(JobQueue* queue, Job* job) {
+    int tail = (queue->head + queue->count) % queue->capacity;
+    queue->jobs[tail] = job;
+    queue->count++;
+    pthread_cond_signal(&queue->not_empty);
+}
+
+// Queue a job from a connection's own thread. Blocks while the queue is
+// full, which pushes back on the submitting connection instead of letting
+// pending work grow without bound.
+void submitJob(Job* job) {
+    JobQueue* queue = jobQueueFor(job);
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == queue->capacity) {
+        pthread_cond_wait(&queue->not_full, &queue->lock);
+    }
+    jobQueuePush(queue, job);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// Queue a job from an event loop or a pool thread, which must never wait
+// for room in a queue that only pool threads drain. When the queue is full
+// the job is parked on its overflow list and takes the next slot a worker
+// frees. Each connection has at most one job outstanding, so the overflow is
+// bounded by the number of connections.
+void submitJobNoWait(Job* job) {
+    JobQueue* queue = jobQueueFor(job);
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count < queue->capacity) {
+        jobQueuePush(queue, job);
+    } else {
+        job->next = NULL;
+        if (queue->overflow_tail) {
+            queue->overflow_tail->next = job;
+        } else {
+            queue->overflow = job;
+        }
+        queue->overflow_tail = job;
+    }
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// Completion state for a caller waiting on its own job
+typedef struct {
+    Job job;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int finished;
+} SyncJob;
+
+static void finishSyncJob(Job* job) {
+    SyncJob* sync = (SyncJob*)job->context;
+    pthread_mutex_lock(&sync->lock);
+    sync->finished = 1;
+    pthread_cond_signal(&sync->cond);
+    pthread_mutex_unlock(&sync->lock);
+}
+
+// Execute a request on the worker (or auth) pool and wait for its response
+void runOnWorkerPool(char* request, Session* session, Response* response) {
+    SyncJob sync;
+    sync.job.request = request;
+    sync.job.session = session;
+    sync.job.response = response;
+    sync.job.done = finishSyncJob;
+    sync.job.run = NULL;
+    sync.job.context = &sync;
+    pthread_mutex_init(&sync.lock, NULL);
+    pthread_cond_init(&sync.cond, NULL);
+    sync.finished = 0;
+
+    submitJob(&sync.job);
+
+    pthread_mutex_lock(&sync.lock);
+    while (!sync.finished) {
+        pthread_cond_wait(&sync.cond, &sync.lock);
+    }
+    pthread_mutex_unlock(&sync.lock);
+    pthread_mutex_destroy(&sync.lock);
+    pthread_cond_destroy(&sync.cond);
+}
+
+// Read more input from a connection. The first byte read decides the
+// protocol. Returns the number of bytes read, 0 on EOF or -1 on error.
+static ssize_t readConnection(Connection* conn) {
+    if (conn->in_cap - conn->in_len < BUFFER_SIZE) {
+        conn->in_cap = conn->in_cap ? conn->in_cap * 2 : BUFFER_SIZE;
+        while (conn->in_cap - conn->in_len < BUFFER_SIZE) conn->in_cap *= 2;
+        conn->in = (char*)countedRealloc(conn->in, conn->in_cap);
+    }
+    ssize_t bytesRead = read(conn->fd, conn->in + conn->in_len, BUFFER_SIZE - 1);
+    if (bytesRead > 0) {
+        if (conn->protocol == PROTOCOL_UNKNOWN) {
+            conn->protocol = conn->in[0] == 0 ? PROTOCOL_FRAMED : PROTOCOL_LEGACY;
+        }
+        conn->in_len += bytesRead;
+    }
+    return bytesRead;
+}
+
+// Find the next complete request in the input buffer. Returns 1 and sets
+// conn->request when one is available, 0 if more input is needed, and -1 if
+// the client sent an oversized frame.
+static int nextRequest(Connection* conn) {
+    if (conn->in_len == 0) return 0;
+
+    if (conn->protocol == PROTOCOL_LEGACY) {
+        conn->in[conn->in_len] = '\0';
+        conn->request = conn->in;
+        conn->request_size = conn->in_len;
+        return 1;
+    }
+
+    if (conn->in_len < FRAME_HEADER_SIZE) return 0;
+    uint32_t length, id;
+    memcpy(&length, conn->in, 4);
+    memcpy(&id, conn->in + 4, 4);
+    length = ntohl(length);
+    if (length > MAX_FRAME_SIZE) return -1;
+
+    size_t frame_size = FRAME_HEADER_SIZE + length;
+    if (conn->in_len < frame_size) {
+        // Make room for the rest of the frame plus its terminator
+        if (conn->in_cap < frame_size + 1) {
+            conn->in_cap = frame_size + 1;
+            conn->in = (char*)countedRealloc(conn->in, conn->in_cap);
+        }
+        return 0;
+    }
+
+    // Terminate the payload in place; the overwritten byte belongs to the next frame
+    conn->saved = conn->in[frame_size];
+    conn->in[frame_size] = '\0';
+    conn->request = conn->in + FRAME_HEADER_SIZE;
+    conn->request_size = frame_size;
+    conn->request_id = ntohl(id);
+    return 1;
+}
+
+// Drop the current request from the input buffer
+static void consumeRequest(Connection* conn) {
+    if (conn->protocol == PROTOCOL_FRAMED) {
+        conn->in[conn->request_size] = conn->saved;
+    }
+    conn->in_len -= conn->request_size;
+    memmove(conn->in, conn->in + conn->request_size, conn->in_len);
+    conn->request = NULL;
+    conn->request_size = 0;
+}
+
+// Make room in a connection's output for extra bytes plus a terminator,
+// dropping what was already sent
+static void outputReserve(Connection* conn, size_t extra) {
+    if (conn->out_sent > 0) {
+        conn->out_len -= conn->out_sent;
+        memmove(conn->out, conn->out + conn->out_sent, conn->out_len);
+        conn->response.start -= conn->out_sent;
+        for (int i = conn->refs_head; i < conn->refs_count; i++) conn->refs[i].at -= conn->out_sent;
+        conn->out_sent = 0;
+    }
+    if (conn->out_cap - conn->out_len > extra) return;
+    if (conn->out_cap == 0) conn->out_cap = BUFFER_SIZE;
+    while (conn->out_cap - conn->out_len <= extra) conn->out_cap *= 2;
+    conn->out = (char*)countedRealloc(conn->out, conn->out_cap);
+}
+
+// Output not yet written to the client
+static int outputPending(const Connection* conn) {
+    return conn->out_len > conn->out_sent || conn->refs_head < conn->refs_count;
+}
+
+// Drop all pending output, handing back what is attached
+static void discardOutput(Connection* conn) {
+    for (int i = conn->refs_head; i < conn->refs_count; i++) {
+        conn->refs[i].release(conn->refs[i].owner);
+    }
+    conn->refs_head = conn->refs_count = 0;
+    conn->ref_sent = 0;
+    conn->out_len = conn->out_sent = 0;
+}
+
+// Start a piece of the current response, leaving room for its frame header
+// if the client uses frames
+static void responseBegin(Response* res) {
+    Connection* conn = res->conn;
+    outputReserve(conn, FRAME_HEADER_SIZE);
+    res->start = conn->out_len;
+    res->attached = 0;
+    res->open = 1;
+    if (conn->protocol == PROTOCOL_FRAMED) conn->out_len += FRAME_HEADER_SIZE;
+}
+
+// Close the piece being built, filling in its frame header with the
+// request's id. more marks a partial response.
+static void responseSeal(Response* res, int more) {
+    Connection* conn = res->conn;
+    if (!res->open) responseBegin(res);
+    res->open = 0;
+    if (conn->protocol == PROTOCOL_FRAMED) {
+        size_t len = conn->out_len - res->start - FRAME_HEADER_SIZE + res->attached;
+        uint32_t length = htonl((uint32_t)len | (more ? FRAME_MORE : 0));
+        uint32_t id = htonl(conn->request_id);
+        memcpy(conn->out + res->start, &length, 4);
+        memcpy(conn->out + res->start + 4, &id, 4);
+    }
+    if (conn->failed) discardOutput(conn);
+}
+
+// Account for bytes written, in output order: the buffer up to the next
+// attached piece, then that piece, and so on
+static void outputWritten(Connection* conn, size_t sent) {
+    while (sent > 0) {
+        OutputRef* ref = conn->refs_head < conn->refs_count ? &conn->refs[conn->refs_head] : NULL;
+        if (ref && conn->out_sent == ref->at) {
+            size_t n = ref->len - conn->ref_sent < sent ? ref->len - conn->ref_sent : sent;
+            conn->ref_sent += n;
+            sent -= n;
+            if (conn->ref_sent == ref->len) {
+                ref->release(ref->owner);
+                conn->refs_head++;
+                conn->ref_sent = 0;
+            }
+        } else {
+            size_t end = ref ? ref->at : conn->out_len;
+            size_t n = end - conn->out_sent < sent ? end - conn->out_sent : sent;
+            conn->out_sent += n;
+            sent -= n;
+        }
+    }
+}
+
+// Write as much of the pending output as the socket accepts, attached pieces
+// straight from where they are kept. Returns 1 when everything has been
+// written, 0 if the socket is full, -1 on error.
+static int sendPending(Connection* conn, int flags) {
+    if (conn->failed) return -1;
+    while (outputPending(conn)) {
+        struct iovec iov[OUTPUT_IOVECS];
+        int n = 0;
+        size_t at = conn->out_sent;
+        int i = conn->refs_head;
+        for (; i < conn->refs_count && n < OUTPUT_IOVECS - 1; i++) {
+            OutputRef* ref = &conn->refs[i];
+            if (ref->at > at) {
+                iov[n].iov_base = conn->out + at;
+                iov[n++].iov_len = ref->at - at;
+                at = ref->at;
+            }
+            size_t skip = i == conn->refs_head ? conn->ref_sent : 0;
+            iov[n].iov_base = (char*)ref->data + skip;
+            iov[n++].iov_len = ref->len - skip;
+        }
+        if (i == conn->refs_count && at < conn->out_len && n < OUTPUT_IOVECS) {
+            iov[n].iov_base = conn->out + at;
+            iov[n++].iov_len = conn->out_len - at;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+        ssize_t sent = sendmsg(conn->fd, &msg, MSG_NOSIGNAL | flags);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            conn->failed = 1;
+            return -1;
+        }
+        outputWritten(conn, sent);
+    }
+    conn->out_len = conn->out_sent = 0;
+    conn->refs_head = conn->refs_count = 0;
+    return 1;
+}
+
+static int flushConnection(Connection* conn) {
+    return sendPending(conn, 0);
+}
+
+// Close the current response; it is written by the following flush
+static void finishResponse(Connection* conn) {
+    responseSeal(&conn->response, 0);
+    __atomic_fetch_add(&requests_served, 1, __ATOMIC_RELAXED);
+}
+
+// Make room for extra bytes plus the terminator at the end of the response
+static void responseReserve(Response* res, size_t extra) {
+    if (!res->open) responseBegin(res);
+    outputReserve(res->conn, extra);
+}
+
+// Bytes in the piece being built
+static size_t responsePieceLength(Response* res) {
+    size_t header = res->conn->protocol == PROTOCOL_FRAMED ? FRAME_HEADER_SIZE : 0;
+    return res->conn->out_len - res->start - header + res->attached;
+}
+
+// Send what has been built so far as a partial response. The connection is
+// owned by the thread building the response, so writing here is safe. The
+// handler may be holding locks, so this never waits for the client: whatever
+// the socket does not take stays queued for the final flush.
+static void responseStream(Response* res) {
+    responseSeal(res, 1);
+    sendPending(res->conn, MSG_DONTWAIT);
+}
+
+void responseAppend(Response* res, const char* data, size_t len) {
+    Connection* conn = res->conn;
+    responseReserve(res, len);
+    memcpy(conn->out + conn->out_len, data, len);
+    conn->out_len += len;
+    if (responsePieceLength(res) >= RESPONSE_CHUNK_SIZE) responseStream(res);
+}
+
+// Add len bytes at data to the response without copying them. The caller
+// holds a reference on owner for them, which release gives back once they
+// are written. They are sent by the next flush or streamed piece, so this
+// never writes to the socket itself and may be called with locks held.
+void responseAttach(Response* res, const char* data, size_t len, void (*release)(void*), void* owner) {
+    Connection* conn = res->conn;
+    responseReserve(res, 0);
+    if (conn->failed || len == 0) {
+        release(owner);
+        return;
+    }
+    if (conn->refs_count == conn->refs_cap) {
+        conn->refs_cap = conn->refs_cap ? conn->refs_cap * 2 : 8;
+        conn->refs = (OutputRef*)countedRealloc(conn->refs, conn->refs_cap * sizeof(OutputRef));
+    }
+    OutputRef* ref = &conn->refs[conn->refs_count++];
+    ref->at = conn->out_len;
+    ref->data = data;
+    ref->len = len;
+    ref->release = release;
+    ref->owner = owner;
+    res->attached += len;
+    if (responsePieceLength(res) >= RESPONSE_CHUNK_SIZE) responseSeal(res, 1);
+}
+
+void responsePuts(Response* res, const char* text) {
+    responseAppend(res, text, strlen(text));
+}
+
+void responsePrintf(Response* res, const char* format, ...) {
+    Connection* conn = res->conn;
+    va_list args;
+    responseReserve(res, 0);
+    va_start(args, format);
+    int n = vsnprintf(conn->out + conn->out_len, conn->out_cap - conn->out_len, format, args);
+    va_end(args);
+    if (n < 0) return;
+    if ((size_t)n >= conn->out_cap - conn->out_len) {
+        responseReserve(res, n);
+        va_start(args, format);
+        vsnprintf(conn->out + conn->out_len, conn->out_cap - conn->out_len, format, args);
+        va_end(args);
+    }
+    conn->out_len += n;
+    if (responsePieceLength(res) >= RESPONSE_CHUNK_SIZE) responseStream(res);
+}
+
+// Allocate the state for a newly accepted connection
+static Connection* newConnection(int fd) {
+    Connection* conn = (Connection*)calloc(1, sizeof(Connection));
+    conn->fd = fd;
+    conn->response.conn = conn;
+    __atomic_fetch_add(&active_connections, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&accepted_connections, 1, __ATOMIC_RELAXED);
+    return conn;
+}
+
+// Free a connection's buffers and the connection itself
+static void freeConnection(Connection* conn) {
+    discardOutput(conn);
+    free(conn->refs);
+    free(conn->in);
+    free(conn->out);
+    free(conn);
+    __atomic_fetch_sub(&active_connections, 1, __ATOMIC_RELAXED);
+}
+
+// Function to handle client connections
+void* handleClient(void* client_socket) {
+    int sock = *(int*)client_socket;
+    free(client_socket);
+
+    Connection* conn = newConnection(sock);
+
+    while (1) {
+        // Read client message
+        ssize_t bytesRead = readConnection(conn);
+        if (bytesRead <= 0) {
+            close(sock);
+            freeConnection(conn);
+            freeThreadBuffers();
+            printf("Client disconnected\n");
+            return NULL;
+        }
+
+        // Process every complete request; a framed client may have sent several
+        int status;
+        while ((status = nextRequest(conn)) > 0) {
+            if (worker_threads || isAuthRequest(conn->request, &conn->session)) {
+                runOnWorkerPool(conn->request, &conn->session, &conn->response);
+            } else {
+                processRequest(conn->request, &conn->session, &conn->response);
+            }
+            int exiting = strcmp(conn->request, "EXIT") == 0;
+
+            // Send response back to client
+            finishResponse(conn);
+            consumeRequest(conn);
+            if (flushConnection(conn) < 0 || exiting) {
+                if (exiting) printf("Client requested to exit\n");
+                close(sock);
+                freeConnection(conn);
+                freeThreadBuffers();
+                return NULL;
+            }
+        }
+        if (status < 0) {
+            printf("Invalid frame, closing connection\n");
+            close(sock);
+            freeConnection(conn);
+            freeThreadBuffers();
+            return NULL;
+        }
+    }
+
+    return NULL;
+}
+
+// Wait for the next event on a connection. Connections are registered with
+// EPOLLONESHOT, so after each event exactly one thread (the event loop, or a
+// worker executing its request) owns the connection until it is re-armed.
+static void watchConnection(Connection* conn, unsigned int events) {
+    struct epoll_event ev;
+    ev.events = events | EPOLLONESHOT;
+    ev.data.ptr = conn;
+    epoll_ctl(conn->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+// Stop watching a connection and free it
+static void closeConnection(Connection* conn) {
+    epoll_ctl(conn->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    freeConnection(conn);
+}
+
+// Accept every pending connection on the (non-blocking) listening socket
+static void acceptConnections(int epfd, int server_fd) {
+    while (1) {
+        struct sockaddr_in client_address;
+        socklen_t client_addrlen = sizeof(client_address);
+        int fd = accept4(server_fd, (struct sockaddr *)&client_address, &client_addrlen, SOCK_NONBLOCK);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("Accept failed");
+            }
+            return;
+        }
+
+        char client_ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &(client_address.sin_addr), client_ip, INET_ADDRSTRLEN);
+        printf("New connection from %s:%d\n", client_ip, ntohs(client_address.sin_port));
+
+        Connection* conn = newConnection(fd);
+        conn->epfd = epfd;
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLONESHOT;
+        ev.data.ptr = conn;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            perror("epoll_ctl failed");
+            close(fd);
+            freeConnection(conn);
+        }
+    }
+}
+
+static void finishConnectionJob(Job* job);
+
+// Finish the response to the current request and start writing it. Returns 1
+// if it was written completely and the next request can be processed;
+// otherwise the connection has been closed or is waiting for EPOLLOUT, so
+// requests on one connection are answered in order.
+static int respond(Connection* conn) {
+    if (strcmp(conn->request, "EXIT") == 0) {
+        printf("Client requested to exit\n");
+        conn->closing = 1;
+    }
+    finishResponse(conn);
+    consumeRequest(conn);
+
+    int flushed = flushConnection(conn);
+    if (flushed < 0 || (flushed && conn->closing)) {
+        closeConnection(conn);
+        return 0;
+    }
+    if (!flushed) {
+        watchConnection(conn, EPOLLOUT);
+        return 0;
+    }
+    return 1;
+}
+
+// Process buffered requests until one is handed to a pool or more input is
+// needed
+static void processConnection(Connection* conn) {
+    while (1) {
+        int status = nextRequest(conn);
+        if (status < 0) {
+            printf("Invalid frame, closing connection\n");
+            closeConnection(conn);
+            return;
+        }
+        if (status == 0) {
+            watchConnection(conn, EPOLLIN);
+            return;
+        }
+        if (worker_threads || isAuthRequest(conn->request, &conn->session)) {
+            conn->job.request = conn->request;
+            conn->job.session = &conn->session;
+            conn->job.response = &conn->response;
+            conn->job.done = finishConnectionJob;
+            conn->job.context = conn;
+            submitJobNoWait(&conn->job);
+            return;
+        }
+        processRequest(conn->request, &conn->session, &conn->response);
+        if (!respond(conn)) return;
+    }
+}
+
+// Worker or auth pool completion for a connection's request. With a worker
+// pool the next request is only queued from here. Otherwise it would run
+// inline on the auth thread, so the connection goes back to its event loop,
+// armed for EPOLLOUT so that requests already buffered are picked up at once.
+static void finishConnectionJob(Job* job) {
+    Connection* conn = (Connection*)job->context;
+    if (!respond(conn)) return;
+    if (worker_threads) {
+        processConnection(conn);
+    } else {
+        watchConnection(conn, EPOLLOUT);
+    }
+}
+
+// Read from a readable connection and process what arrived
+static void serviceConnection(Connection* conn) {
+    ssize_t bytesRead = readConnection(conn);
+    if (bytesRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        watchConnection(conn, EPOLLIN);
+        return;
+    }
+    if (bytesRead <= 0) {
+        printf("Client disconnected\n");
+        closeConnection(conn);
+        return;
+    }
+    processConnection(conn);
+}
+
+// Continue writing a pending response once the socket is writable again, or
+// take back a connection handed over by the auth pool
+static void resumeConnection(Connection* conn) {
+    int flushed = flushConnection(conn);
+    if (flushed < 0 || (flushed && conn->closing)) {
+        closeConnection(conn);
+    } else if (flushed) {
+        processConnection(conn);
+    } else {
+        watchConnection(conn, EPOLLOUT);
+    }
+}
+
+// Event loop serving many connections on one thread. Every loop watches the
+// shared listening socket (EPOLLEXCLUSIVE wakes only one loop per incoming
+// connection) and owns the connections it accepts.
+void* eventLoop(void* listen_socket) {
+    int server_fd = *(int*)listen_socket;
+
+    int epfd = epoll_create1(0);
+    if (epfd < 0) {
+        perror("epoll_create1 failed");
+        exit(EXIT_FAILURE);
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = NULL;   // NULL marks the listening socket
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, server_fd, &ev) < 0) {
+        perror("epoll_ctl failed");
+        exit(EXIT_FAILURE);
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait failed");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < n; i++) {
+            Connection* conn = (Connection*)events[i].data.ptr;
+            if (!conn) {
+                acceptConnections(epfd, server_fd);
+            } else if (outputPending(conn) || (events[i].events & EPOLLOUT)) {
+                resumeConnection(conn);
+            } else {
+                serviceConnection(conn);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+// Split the next word off a request in place. Unlike strtok() this keeps
+// its position in the caller's cursor, so requests on different threads do
+// not disturb each other. Returns NULL once no words are left; len, if
+// given, receives the word's length.
+static char* nextWord(char** cursor, size_t* len) {
+    char* word = *cursor + strspn(*cursor, WORD_DELIMITERS);
+    size_t n = strcspn(word, WORD_DELIMITERS);
+    if (n == 0) {
+        *cursor = word;
+        return NULL;
+    }
+    *cursor = word + n;
+    if (**cursor) *(*cursor)++ = '\0';
+    if (len) *len = n;
+    return word;
+}
+
+// Role named by the first word of a request, or 0 if it is not a role
+static enum UserType roleOf(const char* word, size_t len) {
+    if (len == 5 && strncmp(word, "ADMIN", 5) == 0) return ADMIN;
+    if (len == 7 && strncmp(word, "STUDENT", 7) == 0) return STUDENT;
+    if (len == 7 && strncmp(word, "FACULTY", 7) == 0) return FACULTY;
+    return 0;
+}
+
+// Run a command as the session's user, with the table lock already held. The
+// user is resolved from the cached position, since the users array may move.
+static void runCommand(Session* session, char* command, Response* res) {
+    User* user = session->position < users_size ? &users[session->position] : NULL;
+    if (!user || user->id != session->userId) {
+        countRejected();
+        responsePuts(res, "Access denied");
+    } else if (!user->active) {
+        countRejected();
+        responsePuts(res, "Account deactivated");
+    } else {
+        dispatchCommand(user, command, res);
+    }
+}
+
+// Undo the changes of an aborted atomic batch, latest first, so that each
+// record is put back to what it was, in the same slot and list positions
+static void undoBatch(Batch* batch) {
+    for (int i = batch->undo_count - 1; i >= 0; i--) {
+        UndoEntry* entry = &batch->undo[i];
+        int position = entry->position;
+        switch (entry->kind) {
+        case UNDO_USER_ADDED:
+            indexRemove(&userIdIndex, position);
+            indexRemove(&usernameIndex, position);
+            free(studentCourses[position].ids);
+            users_size--;
+            break;
+        case UNDO_USER_CHANGED:
+            indexRemove(&usernameIndex, position);
+            if (users[position].username != entry->user.username && entry->user.type == FACULTY) {
+                catalogChanged();
+            }
+            users[position] = entry->user;
+            indexInsert(&usernameIndex, position);
+            break;
+        case UNDO_COURSE_ADDED:
+            indexRemove(&courseIdIndex, position);
+            indexRemove(&courseCodeIndex, position);
+            free(courseStudents[position].ids);
+            free(courseWaitlists[position].ids);
+            memset(&courseStudents[position], 0, sizeof(IdList));
+            memset(&courseWaitlists[position], 0, sizeof(IdQueue));
+            memset(&courses[position], 0, sizeof(Course));
+            if (entry->reused) {
+                idListAdd(&freeCourseSlots, position);
+            } else {
+                courses_size--;
+            }
+            last_course_id = entry->lastCourseId;
+            catalogChanged();
+            break;
+        case UNDO_COURSE_REMOVED:
+            freeCourseSlots.size--;
+            courses[position] = entry->course;
+            courseWaitlists[position] = entry->waitlist;
+            indexInsert(&courseIdIndex, position);
+            indexInsert(&courseCodeIndex, position);
+            catalogChanged();
+            break;
+        case UNDO_SEATS:
+            courses[position].totalSeats = entry->course.totalSeats;
+            courses[position].enrolledStudents = entry->course.enrolledStudents;
+            catalogSeatsChanged(&courses[position]);
+            break;
+        case UNDO_ENROLLMENT_ADDED: {
+            indexRemove(&enrollmentIndex, position);
+            enrollments[position].studentId = 0;
+            enrollments[position].courseId = 0;
+            if (entry->reused) {
+                idListAdd(&freeEnrollmentSlots, position);
+            } else {
+                enrollments_size--;
+            }
+            IdList* enrolled = coursesOfStudent(entry->studentId);
+            IdList* roster = studentsOfCourse(entry->courseId);
+            if (enrolled) idListRemove(enrolled, entry->courseId);
+            if (roster) idListRemove(roster, entry->studentId);
+            break;
+        }
+        case UNDO_ENROLLMENT_REMOVED: {
+            freeEnrollmentSlots.size--;
+            enrollments[position].studentId = entry->studentId;
+            enrollments[position].courseId = entry->courseId;
+            indexInsert(&enrollmentIndex, position);
+            IdList* enrolled = coursesOfStudent(entry->studentId);
+            IdList* roster = studentsOfCourse(entry->courseId);
+            if (enrolled && entry->at >= 0) idListInsert(enrolled, entry->at, entry->courseId);
+            if (roster && entry->rosterAt >= 0) idListInsert(roster, entry->rosterAt, entry->studentId);
+            break;
+        }
+        case UNDO_WAITLIST_PUSHED:
+            courseWaitlists[position].size--;
+            break;
+        case UNDO_WAITLIST_REMOVED:
+            idQueueInsert(&courseWaitlists[position], entry->at, entry->studentId);
+            break;
+        }
+    }
+}
+
+// Read a whole file into a NUL-terminated buffer, or return NULL
+static char* readWholeFile(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (!file) return NULL;
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+    char* text = (char*)countedRealloc(NULL, size + 1);
+    text[fread(text, 1, size, file)] = '\0';
+    fclose(file);
+    return text;
+}
+
+// Passwords are stored as salted yescrypt hashes. Entries written before
+// hashing was added hold the plain password: they are still accepted, and
+// replaced by a hash the first time their user logs in.
+static int isPasswordHash(const char* stored) {
+    return strncmp(stored, PASSWORD_HASH_PREFIX, strlen(PASSWORD_HASH_PREFIX)) == 0;
+}
+
+// Hash a password under a fresh salt into hash (CRYPT_OUTPUT_SIZE bytes).
+// Returns 0 if libcrypt fails.
+int hashPassword(const char* password, char* hash) {
+    char salt[CRYPT_GENSALT_OUTPUT_SIZE];
+    struct crypt_data data;
+    memset(&data, 0, sizeof(data));
+    if (!crypt_gensalt_rn(PASSWORD_HASH_PREFIX, 0, NULL, 0, salt, sizeof(salt))) return 0;
+    const char* result = crypt_r(password, salt, &data);
+    if (!result || *result == '*') return 0;
+    snprintf(hash, CRYPT_OUTPUT_SIZE, "%s", result);
+    return 1;
+}
+
+// Check a password against a stored hash or plain password. The comparison
+// does not stop at the first differing byte.
+static int checkPassword(const char* password, const char* stored) {
+    struct crypt_data data;
+    const char* given = password;
+    if (isPasswordHash(stored)) {
+        memset(&data, 0, sizeof(data));
+        given = crypt_r(password, stored, &data);
+        if (!given) return 0;
+    }
+    size_t len = strlen(stored);
+    if (strlen(given) != len) return 0;
+    unsigned char diff = 0;
+    for (size_t i = 0; i < len; i++) diff |= given[i] ^ stored[i];
+    return diff == 0;
+}
+
+// Passwords hashed for the current request before it took the table lock, in
+// the order its commands set them. A handler takes the hash made from the
+// exact plain password it is setting and hashes anything else itself, so
+// what gets stored never depends on what a password looks like. The plain
+// password is left where the request (or the import's file) has it.
+typedef struct {
+    const char* plain;
+    int plainLen;
+    char hash[PASSWORD_HASH_SIZE];  // empty if hashing failed or it did not fit
+} PreparedPassword;
+
+// A row of an IMPORT_USERS, checked before the table lock
+typedef struct {
+    const char* username;
+    const char* password;
+    int usernameLen, passwordLen;
+    enum UserType type;         // 0 if the row is invalid
+    int line;                   // line number in the CSV
+} ImportRow;
+
+// An IMPORT_USERS parsed before the table lock: its rows were read once, from
+// the request or the server-local file it names, and their passwords queued
+typedef struct {
+    char* file;                 // contents of the file, NULL for rows sent inline
+    const char* path;           // the file's name, NULL for rows sent inline
+    int pathLen;
+    int failed;                 // the file could not be read
+    int first, count;           // its rows in PreparedCredentials.rows
+} PreparedImport;
+
+typedef struct {
+    PreparedPassword* passwords;
+    int count, capacity;
+    int next;                   // first one no handler has taken yet
+    ImportRow* rows;
+    int rowCount, rowCapacity;
+    PreparedImport* imports;    // in the order the request's commands run
+    int importCount, importCapacity;
+    int nextImport;
+    int active;                 // set while the request has prepared credentials
+    struct timespec started;    // when preparing began
+    // Current password of one CHANGE_PASSWORD, checked against the stored one
+    int checkedUser;            // 0 if none was checked
+    StringRef checkedStored;
+    char checkedPlain[MAX_STR];
+    int match;
+} PreparedCredentials;
+
+__thread PreparedCredentials prepared;
+
+void importUsers(const PreparedImport* import, Response* res);
+
+// Queue a plain password to be hashed by hashPreparedPasswords()
+static void preparePassword(const char* plain, size_t len) {
+    if (prepared.count == prepared.capacity) {
+        prepared.capacity = prepared.capacity ? prepared.capacity * 2 : 8;
+        prepared.passwords = (PreparedPassword*)countedRealloc(prepared.passwords,
+                                                               prepared.capacity * sizeof(PreparedPassword));
+    }
+    PreparedPassword* password = &prepared.passwords[prepared.count++];
+    password->plain = plain;
+    password->plainLen = (int)len;
+    password->hash[0] = '\0';
+}
+
+// Hashing of one request's prepared passwords. The thread running the
+// request hashes them itself and queues helper jobs on the auth pool, which
+// take passwords from the same counter. It waits only for the passwords a
+// helper has taken, never for the queue, so requests hashing on every auth
+// thread at once cannot stall each other; a helper that starts once no
+// password is left does nothing. Each auth thread has its own, whose helper
+// jobs are queued again only after they have left the queue.
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t idle;
+    PreparedPassword* passwords;
+    int count;
+    int next;                   // next password to take
+    int active;                 // the request is hashing
+    int helping;                // helpers hashing now
+    Job* helpers;               // one per other auth thread
+    int* queued;                // whether each helper is on the auth queue
+} HashWork;
+
+__thread HashWork hash_work = { .lock = PTHREAD_MUTEX_INITIALIZER, .idle = PTHREAD_COND_INITIALIZER };
+
+static void hashPasswords(HashWork* work) {
+    int i;
+    while ((i = __atomic_fetch_add(&work->next, 1, __ATOMIC_RELAXED)) < work->count) {
+        PreparedPassword* password = &work->passwords[i];
+        char plain[MAX_STR], hash[CRYPT_OUTPUT_SIZE];
+        snprintf(plain, sizeof(plain), "%.*s", password->plainLen, password->plain);
+        if (hashPassword(plain, hash) && strlen(hash) < sizeof(password->hash)) strcpy(password->hash, hash);
+    }
+}
+
+// Auth pool job helping another auth thread's request hash its passwords
+static void hashHelper(Job* job) {
+    HashWork* work = (HashWork*)job->context;
+    pthread_mutex_lock(&work->lock);
+    work->queued[job - work->helpers] = 0;
+    if (!work->active) {
+        pthread_mutex_unlock(&work->lock);
+        return;
+    }
+    work->helping++;
+    pthread_mutex_unlock(&work->lock);
+
+    hashPasswords(work);
+
+    pthread_mutex_lock(&work->lock);
+    if (--work->helping == 0) pthread_cond_signal(&work->idle);
+    pthread_mutex_unlock(&work->lock);
+}
+
+// Hash the queued passwords. Many of them (an import) are spread over the
+// auth pool; requests running anywhere else hash alone.
+static void hashPreparedPasswords() {
+    HashWork* work = &hash_work;
+    int helpers = pool_queue == &auth_queue ? auth_threads - 1 : 0;
+    if (helpers > prepared.count - 1) helpers = prepared.count - 1;
+    if (helpers > 0 && !work->helpers) {
+        work->helpers = (Job*)countedRealloc(NULL, auth_threads * sizeof(Job));
+        work->queued = (int*)countedRealloc(NULL, auth_threads * sizeof(int));
+        memset(work->helpers, 0, auth_threads * sizeof(Job));
+        memset(work->queued, 0, auth_threads * sizeof(int));
+        for (int i = 0; i < auth_threads; i++) {
+            work->helpers[i].run = hashHelper;
+            work->helpers[i].context = work;
+        }
+    }
+
+    pthread_mutex_lock(&work->lock);
+    work->passwords = prepared.passwords;
+    work->count = prepared.count;
+    work->next = 0;
+    work->active = 1;
+    for (int i = 0; i < helpers; i++) {
+        if (!work->queued[i]) {
+            work->queued[i] = 1;
+            submitJobNoWait(&work->helpers[i]);
+        }
+    }
+    pthread_mutex_unlock(&work->lock);
+
+    hashPasswords(work);
+
+    pthread_mutex_lock(&work->lock);
+    work->active = 0;
+    while (work->helping > 0) {
+        pthread_cond_wait(&work->idle, &work->lock);
+    }
+    pthread_mutex_unlock(&work->lock);
+}
+
+// Forget the prepared credentials of the finished request
+static void clearPreparedCredentials() {
+    for (int i = 0; i < prepared.importCount; i++) free(prepared.imports[i].file);
+    PreparedCredentials kept = prepared;
+    memset(&prepared, 0, sizeof(prepared));
+    prepared.passwords = kept.passwords;
+    prepared.capacity = kept.capacity;
+    prepared.rows = kept.rows;
+    prepared.rowCapacity = kept.rowCapacity;
+    prepared.imports = kept.imports;
+    prepared.importCapacity = kept.importCapacity;
+}
+
+// Free the buffers the calling thread keeps for its next requests, before a
+// connection's own thread exits
+void freeThreadBuffers() {
+    free(prepared.passwords);
+    free(prepared.rows);
+    free(prepared.imports);
+    memset(&prepared, 0, sizeof(prepared));
+    free(batch_buffers.records);
+    free(batch_buffers.undo);
+    memset(&batch_buffers, 0, sizeof(batch_buffers));
+    free(flat_waitlists);
+    flat_waitlists = NULL;
+    flat_waitlists_cap = 0;
+}
+
+// Hash prepared for this plain password, if any. Handlers set passwords in
+// the order they were prepared, so the search resumes after the last one.
+static const char* takePreparedHash(const char* plain) {
+    size_t len = strlen(plain);
+    for (int i = prepared.next; i < prepared.count; i++) {
+        const PreparedPassword* password = &prepared.passwords[i];
+        if (password->plainLen == (int)len && memcmp(password->plain, plain, len) == 0) {
+            prepared.next = i + 1;
+            return password->hash[0] ? password->hash : NULL;
+        }
+    }
+    return NULL;
+}
+
+// Set a new password on a user record, with the hash prepared for it before
+// the table lock was taken, or else one made here. Returns 0 if hashing failed.
+static int setPassword(StringRef* password, const char* plain) {
+    char buffer[CRYPT_OUTPUT_SIZE];
+    const char* hash = takePreparedHash(plain);
+    if (!hash) {
+        if (!hashPassword(plain, buffer)) return 0;
+        hash = buffer;
+    }
+    *password = internString(hash);
+    return 1;
+}
+
+// Whether plain is the user's current password, using the check made before
+// the table lock if it was of the same password against the same stored hash
+static int checkCurrentPassword(const User* user, const char* plain) {
+    if (prepared.checkedUser == user->id && prepared.checkedStored == user->password &&
+        strcmp(prepared.checkedPlain, plain) == 0) {
+        return prepared.match;
+    }
+    return checkPassword(plain, stringAt(user->password));
+}
+
+// Parse what follows IMPORT_USERS: CSV rows "username,password[,STUDENT|FACULTY]"
+// (students by default; blank lines and lines starting with '#' are skipped),
+// or "FILE <path>" naming a server-local file of them. The rows are read once
+// and checked, and the passwords of the valid ones queued, all before the
+// table lock; importUsers() then only adds them.
+static void prepareImport(const char* text) {
+    if (prepared.importCount == prepared.importCapacity) {
+        prepared.importCapacity = prepared.importCapacity ? prepared.importCapacity * 2 : 4;
+        prepared.imports = (PreparedImport*)countedRealloc(prepared.imports,
+                                                           prepared.importCapacity * sizeof(PreparedImport));
+    }
+    PreparedImport* import = &prepared.imports[prepared.importCount++];
+    memset(import, 0, sizeof(*import));
+    import->first = prepared.rowCount;
+
+    const char* csv = text;
+    if (strncmp(text, "FILE ", 5) == 0) {
+        char path[MAX_STR];
+        import->path = text + 5 + strspn(text + 5, WORD_DELIMITERS);
+        import->pathLen = (int)strcspn(import->path, WORD_DELIMITERS);
+        if (import->pathLen > 0 && import->pathLen < MAX_STR) {
+            snprintf(path, sizeof(path), "%.*s", import->pathLen, import->path);
+            import->file = readWholeFile(path);
+        }
+        if (!import->file) {
+            import->failed = 1;
+            return;
+        }
+        csv = import->file;
+    }
+
+    int lineNumber = 0;
+    for (const char* line = csv; *line; ) {
+        size_t len = strcspn(line, "\n");
+        const char* next = line + len + (line[len] != '\0');
+        lineNumber++;
+        if (len > 0 && line[len-1] == '\r') len--;
+        if (len == 0 || *line == '#') {
+            line = next;
+            continue;
+        }
+
+        if (prepared.rowCount == prepared.rowCapacity) {
+            prepared.rowCapacity = prepared.rowCapacity ? prepared.rowCapacity * 2 : 64;
+            prepared.rows = (ImportRow*)countedRealloc(prepared.rows, prepared.rowCapacity * sizeof(ImportRow));
+        }
+        ImportRow* row = &prepared.rows[prepared.rowCount++];
+        const char* end = line + len;
+        const char* comma = memchr(line, ',', len);
+        const char* type = comma ? memchr(comma + 1, ',', end - comma - 1) : NULL;
+        row->line = lineNumber;
+        row->username = line;
+        row->usernameLen = comma ? (int)(comma - line) : (int)len;
+        row->password = comma ? comma + 1 : end;
+        row->passwordLen = (int)((type ? type : end) - row->password);
+        row->type = !type || (end - type == 8 && strncmp(type + 1, "STUDENT", 7) == 0) ? STUDENT :
+                    end - type == 8 && strncmp(type + 1, "FACULTY", 7) == 0 ? FACULTY : 0;
+        if (!comma || row->usernameLen == 0 || row->passwordLen == 0 ||
+            row->usernameLen >= MAX_STR || row->passwordLen >= MAX_STR ||
+            memchr(row->username, ' ', row->usernameLen) || memchr(row->username, '\t', row->usernameLen) ||
+            memchr(row->password, ' ', row->passwordLen) || memchr(row->password, '\t', row->passwordLen)) {
+            row->type = 0;
+        }
+        if (row->type) preparePassword(row->password, row->passwordLen);
+        line = next;
+    }
+    import->count = prepared.rowCount - import->first;
+}
+
+static int isWord(const char* word, size_t len, const char* name) {
+    return len == strlen(name) && strncmp(word, name, len) == 0;
+}
+
+// Queue the new password of a command for hashing before the table lock is
+// taken, parse the rows of an IMPORT_USERS, and check the current password
+// of a CHANGE_PASSWORD
+static void prepareCredentials(Session* session, const char* command) {
+    const char* words[4];
+    size_t lens[4];
+    int count = 0;
+    const char* cursor = command;
+    while (count < 4) {
+        cursor += strspn(cursor, WORD_DELIMITERS);
+        if (!*cursor) break;
+        words[count] = cursor;
+        lens[count] = strcspn(cursor, WORD_DELIMITERS);
+        cursor += lens[count++];
+    }
+    // Unused words are empty, so they match no name
+    for (int i = count; i < 4; i++) {
+        words[i] = cursor;
+        lens[i] = 0;
+    }
+    if (!prepared.active) {
+        prepared.active = 1;
+        clock_gettime(CLOCK_MONOTONIC, &prepared.started);
+    }
+
+    int index = 0;
+    if (isWord(words[0], lens[0], "IMPORT_USERS")) {
+        const char* rows = words[0] + lens[0];
+        prepareImport(rows + strspn(rows, WORD_DELIMITERS));
+    } else if (isWord(words[0], lens[0], "ADD_STUDENT") || isWord(words[0], lens[0], "ADD_FACULTY")) {
+        index = 2;
+    } else if (isWord(words[0], lens[0], "UPDATE_USER") && isWord(words[2], lens[2], "password")) {
+        index = 3;
+    } else if (isWord(words[0], lens[0], "CHANGE_PASSWORD")) {
+        index = 2;
+        char stored[MAX_STR];
+        acquireReadLock();
+        User* user = findUserById(session->userId);
+        StringRef ref = user ? user->password : 0;
+        if (user) snprintf(stored, sizeof(stored), "%s", stringAt(ref));
+        releaseLock();
+        if (user && count > 1 && lens[1] < MAX_STR && !prepared.checkedUser) {
+            snprintf(prepared.checkedPlain, sizeof(prepared.checkedPlain), "%.*s", (int)lens[1], words[1]);
+            prepared.match = checkPassword(prepared.checkedPlain, stored);
+            prepared.checkedStored = ref;
+            prepared.checkedUser = session->userId;
+        }
+    }
+    if (index && count > index && lens[index] < MAX_STR) preparePassword(words[index], lens[index]);
+}
+
+// BATCH [ATOMIC], followed by one command per line. The commands run in order
+// under a single acquisition of the table lock and their changes are made
+// durable once at the end. Each result is prefixed with "#<n> ". In an atomic
+// batch the first command that fails (makes no change, unless it is a VIEW_
+// command) undoes the changes of the whole batch.
+static void executeBatch(Session* session, char* request, Response* res) {
+    char* lines = request + strcspn(request, "\n");
+    if (*lines) *lines++ = '\0';
+    char* cursor = request;
+    nextWord(&cursor, NULL);
+    char* option = nextWord(&cursor, NULL);
+
+    request_kind = STAT_BATCH;
+    Batch batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.records = batch_buffers.records;
+    batch.records_cap = batch_buffers.records_cap;
+    batch.undo = batch_buffers.undo;
+    batch.undo_cap = batch_buffers.undo_cap;
+    if (option && strcmp(option, "ATOMIC") == 0) {
+        batch.atomic = 1;
+    } else if (option) {
+        responsePuts(res, "Invalid batch option");
+        return;
+    }
+
+    // One lock for the whole batch: exclusive if any command needs it, or to
+    // keep others from seeing an atomic batch's changes before it commits.
+    // The passwords the commands set are hashed before it is taken.
+    int exclusive = batch.atomic;
+    int credentials = 0;
+    for (char* line = lines; *line; line = strchr(line, '\n') ? strchr(line, '\n') + 1 : "") {
+        int flags = commandFlags(session->type, line);
+        if (flags & COMMAND_STRUCTURAL) exclusive = 1;
+        if (flags & COMMAND_PASSWORD) {
+            // Prepared on the line alone, ended in place for the time being
+            char* end = line + strcspn(line, "\n");
+            char c = *end;
+            *end = '\0';
+            prepareCredentials(session, line);
+            *end = c;
+            credentials = 1;
+        }
+    }
+    if (credentials) hashPreparedPasswords();
+    if (exclusive) {
+        acquireWriteLock();
+    } else {
+        acquireReadLock();
+    }
+
+    active_batch = &batch;
+    int count = 0;
+    int failed = 0;
+    while (*lines && !failed) {
+        char* line = lines;
+        size_t len = strcspn(line, "\n");
+        lines += len + (line[len] != 0);
+        line[len] = '\0';
+        if (len > 0 && line[len-1] == '\r') line[--len] = '\0';
+        if (len == 0) continue;
+
+        count++;
+        responsePrintf(res, "#%d ", count);
+        if (strncmp(line, "BATCH", 5) == 0 && (line[5] == ' ' || line[5] == '\0')) {
+            responsePuts(res, "BATCH cannot be nested");
+            failed = batch.atomic;
+        } else {
+            int changes = batch.changes;
+            int readOnly = commandFlags(session->type, line) & COMMAND_READ_ONLY;
+            runCommand(session, line, res);
+            failed = batch.atomic && !readOnly && batch.changes == changes;
+        }
+        responsePuts(res, "\n");
+    }
+    active_batch = NULL;
+
+    if (failed) {
+        undoBatch(&batch);
+        responsePrintf(res, "BATCH_ABORTED at #%d, no changes were made", count);
+    } else {
+        commitBatch(&batch);
+        responsePrintf(res, "BATCH_OK %d", count);
+    }
+    releaseLock();
+    clearPreparedCredentials();
+    // A removed course's waitlist was kept for undoing; free it now
+    for (int i = 0; i < batch.undo_count; i++) {
+        if (!failed && batch.undo[i].kind == UNDO_COURSE_REMOVED) free(batch.undo[i].waitlist.ids);
+    }
+    batch_buffers = batch;
+}
+
+// Run a command as the session's user
+static void executeAs(Session* session, char* command, Response* res) {
+    if (strncmp(command, "BATCH", 5) == 0 && strchr(" \n", command[5])) {
+        executeBatch(session, command, res);
+        return;
+    }
+    int flags = commandFlags(session->type, command);
+    if (flags & COMMAND_PASSWORD) {
+        prepareCredentials(session, command);
+        hashPreparedPasswords();
+    }
+    if (flags & COMMAND_STRUCTURAL) {
+        acquireWriteLock();
+    } else {
+        acquireReadLock();
+    }
+    runCommand(session, command, res);
+    releaseLock();
+    clearPreparedCredentials();
+}
+
+// Parse a request and run it, or refuse it
+static void handleRequest(char* request, Session* session, Response* res) {
+    char* text = request;
+    size_t len = strcspn(text, WORD_DELIMITERS);
+    enum UserType role = roleOf(text, len);
+    int login = len == 5 && strncmp(text, "LOGIN", 5) == 0;
+
+    // Short form: the whole request is a command for the session's user
+    if (session->userId && !role && !login) {
+        executeAs(session, text, res);
+        return;
+    }
+
+    char* cursor = text;
+    if (!nextWord(&cursor, NULL)) {
+        countRejected();
+        responsePuts(res, "Invalid request");
+        return;
+    }
+
+    // Handle login request
+    if (login) {
+        request_kind = STAT_LOGIN;
+        char* username = nextWord(&cursor, NULL);
+        char* password = nextWord(&cursor, NULL);
+        if (username && password) {
+            loginUser(username, password, session, res);
+        } else {
+            countRejected();
+            responsePuts(res, "Invalid login format");
+        }
+    }
+    // Handle role-specific requests
+    else if (role) {
+        char* userIdStr = nextWord(&cursor, NULL);
+        if (!userIdStr) {
+            countRejected();
+            responsePuts(res, "Invalid request format");
+            return;
+        }
+        if (!session->userId) {
+            countRejected();
+            responsePuts(res, "Not logged in");
+            return;
+        }
+        if (atoi(userIdStr) != session->userId || role != session->type) {
+            countRejected();
+            responsePuts(res, "Access denied");
+            return;
+        }
+        executeAs(session, cursor, res);
+    } else {
+        countRejected();
+        responsePuts(res, "Invalid request format");
+    }
+}
+
+// Whether a request belongs on the auth pool: LOGIN, or a command of the
+// session's role that sets a password, or a BATCH with one
+int isAuthRequest(const char* request, const Session* session) {
+    const char* word = request + strspn(request, WORD_DELIMITERS);
+    size_t len = strcspn(word, WORD_DELIMITERS);
+    if (len == 5 && strncmp(word, "LOGIN", 5) == 0) return 1;
+    if (!session->userId) return 0;
+    if (roleOf(word, len)) {
+        // Skip "<ROLE> <id>"
+        word += len;
+        word += strspn(word, WORD_DELIMITERS);
+        word += strcspn(word, WORD_DELIMITERS);
+        word += strspn(word, WORD_DELIMITERS);
+        len = strcspn(word, WORD_DELIMITERS);
+    }
+    if (isWord(word, len, "BATCH")) {
+        for (const char* line = strchr(word, '\n'); line; line = strchr(line + 1, '\n')) {
+            if (commandFlags(session->type, line + 1) & COMMAND_PASSWORD) return 1;
+        }
+        return 0;
+    }
+    return (commandFlags(session->type, word) & COMMAND_PASSWORD) != 0;
+}
+
+// Process client requests. After LOGIN, commands act as the logged in user:
+// either "<ROLE> <id> <command>", where role and id must match the session,
+// or just "<command>". Each request's latency is recorded under its command.
+void processRequest(const char* request, Session* session, Response* res) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    request_kind = STAT_OTHER;
+    handleRequest((char*)request, session, res);
+    histogramAdd(&threadStats()->commands[request_kind], microsSince(&start));
+}
+
+// User login. On success the session is bound to the user; a failed login
+// ends any earlier session. The stored password is copied under the table
+// lock and checked after releasing it, so hashing holds up no other request.
+// A plain password left from before hashing is replaced by its hash.
+void loginUser(const char* username, const char* password, Session* session, Response* res) {
+    memset(session, 0, sizeof(*session));
+    char stored[MAX_STR];
+    acquireReadLock();
+    User* user = findUserByUsername(username);
+    int userId = user ? user->id : 0;
+    StringRef ref = user ? user->password : 0;
+    // Unknown users cost a hash as well, so timing does not tell them apart
+    snprintf(stored, sizeof(stored), "%s", user ? stringAt(ref) : UNKNOWN_USER_HASH);
+    releaseLock();
+    if (!checkPassword(password, stored) || !userId) {
+        responsePuts(res, "LOGIN_FAILED Invalid credentials");
+        return;
+    }
+
+    char hash[CRYPT_OUTPUT_SIZE];
+    int migrate = !isPasswordHash(stored) && hashPassword(password, hash);
+    if (migrate) {
+        acquireWriteLock();
+    } else {
+        acquireReadLock();
+    }
+    // The password may have changed while it was being checked
+    user = findUserById(userId);
+    if (!user || user->password != ref) {
+        releaseLock();
+        responsePuts(res, "LOGIN_FAILED Invalid credentials");
+        return;
+    }
+    if (migrate) {
+        user->password = internString(hash);
+        persistUser(user);
+    }
+    if (!user->active) {
+        releaseLock();
+        responsePuts(res, "LOGIN_FAILED Account deactivated");
+        return;
+    }
+    session->userId = user->id;
+    session->position = user - users;
+    session->type = user->type;
+    releaseLock();
+    const char* userType = session->type == ADMIN ? "ADMIN" :
+                           session->type == STUDENT ? "STUDENT" : "FACULTY";
+    responsePrintf(res, "LOGIN_SUCCESS %s %d", userType, session->userId);
+}
+
+// Add a student or faculty account: <username> <password>
+static void addAccount(enum UserType type, Command* cmd, Response* res) {
+    const char* kind = type == STUDENT ? "Student" : "Faculty";
+    char* username = cmd->args[0];
+    char* password = cmd->args[1];
+    if (findUserByUsername(username)) {
+        responsePrintf(res, "%s with username %s already exists", kind, username);
+        return;
+    }
+    User user;
+    if (!setPassword(&user.password, password)) {
+        responsePuts(res, "Password could not be hashed");
+        return;
+    }
+    user.id = users_size ? users[users_size-1].id + 1 : 1;
+    user.username = internString(username);
+    user.type = type;
+    user.active = 1;
+    addUser(&user);
+    persistUser(&user);
+    responsePrintf(res, "%s added successfully with ID %d", kind, user.id);
+}
+
+static void adminAddStudent(User* admin, Command* cmd, Response* res) {
+    addAccount(STUDENT, cmd, res);
+}
+
+static void adminAddFaculty(User* admin, Command* cmd, Response* res) {
+    addAccount(FACULTY, cmd, res);
+}
+
+static void adminToggleStudent(User* admin, Command* cmd, Response* res) {
+    int studentId = atoi(cmd->args[0]);
+    User* student = findUserById(studentId);
+    if (!student || student->type != STUDENT) {
+        responsePuts(res, "Student not found");
+        return;
+    }
+    undoUser(student);
+    student->active = !student->active;
+    persistUser(student);
+    responsePrintf(res, "Student %s %s successfully", stringAt(student->username), 
+                   student->active ? "activated" : "deactivated");
+}
+
+static void adminUpdateUser(User* admin, Command* cmd, Response* res) {
+    int userId = atoi(cmd->args[0]);
+    char* field = cmd->args[1];
+    char* value = cmd->args[2];
+    User* user = findUserById(userId);
+    if (!user) {
+        responsePuts(res, "User not found");
+        return;
+    }
+    if (strcmp(field, "password") == 0) {
+        undoUser(user);
+        if (setPassword(&user->password, value)) {
+            persistUser(user);
+            responsePuts(res, "Password updated successfully");
+        } else {
+            responsePuts(res, "Password could not be hashed");
+        }
+    }
+    else if (strcmp(field, "username") == 0) {
+        if (findUserByUsername(value)) {
+            responsePrintf(res, "Username %s already exists", value);
+        } else {
+            renameUser(user, value);
+            persistUser(user);
+            responsePuts(res, "Username updated successfully");
+        }
+    }
+    else {
+        responsePuts(res, "Invalid field to update");
+    }
+}
+
+static void adminViewUsers(User* admin, Command* cmd, Response* res) {
+    responsePuts(res, "Users list:\n");
+    for (int i = 0; i < users_size; i++) {
+        const char* userType = users[i].type == ADMIN ? "ADMIN" : 
+                             users[i].type == STUDENT ? "STUDENT" : "FACULTY";
+        responsePrintf(res, "ID: %d, Username: %s, Type: %s, Status: %s\n", 
+                       users[i].id, stringAt(users[i].username), userType, 
+                       users[i].active ? "Active" : "Inactive");
+    }
+}
+
+static void adminBgsave(User* admin, Command* cmd, Response* res) {
+    requestBackgroundSave(res);
+}
+
+static void adminMemory(User* admin, Command* cmd, Response* res) {
+    unsigned long served = __atomic_load_n(&requests_served, __ATOMIC_RELAXED);
+    unsigned long allocations = __atomic_load_n(&request_allocations, __ATOMIC_RELAXED);
+    responsePrintf(res, "Requests served: %lu\nAllocations while serving them: %lu\n",
+                   served, allocations);
+    responsePrintf(res, "Users: %d x %zu bytes\nCourses: %d x %zu bytes\n"
+                   "String pool: %zu strings in %zu bytes\n",
+                   users_size, sizeof(User), courses_size, sizeof(Course),
+                   intern_count, string_pool_len);
+}
+
+static void adminStats(User* admin, Command* cmd, Response* res) {
+    writeStats(res);
+}
+
+static void adminImportUsers(User* admin, Command* cmd, Response* res) {
+    // Parsed before the table lock was taken, unless it was not prepared
+    if (prepared.nextImport == prepared.importCount) prepareImport(cmd->text ? cmd->text : "");
+    const PreparedImport* import = &prepared.imports[prepared.nextImport++];
+    if (import->failed) {
+        if (import->pathLen > 0) {
+            responsePrintf(res, "Cannot open %.*s", import->pathLen, import->path);
+        } else {
+            responsePuts(res, "Cannot open file");
+        }
+        return;
+    }
+    importUsers(import, res);
+}
+
+// A rendered VIEW_COURSES listing. It is rendered again only when
+// catalog_version moves; when just seat counts changed, the rows of the
+// courses in the seat log are patched in place. The text is kept in chunks of
+// about RESPONSE_CHUNK_SIZE bytes, which responses attach instead of copying.
+// A response holds a reference on each chunk it sends, so a chunk that must
+// change while one is held is copied first (only that chunk, not the
+// listing), and chunks nobody holds any more go back on the cache's spare
+// list for reuse. The cache itself is only touched under its mutex, since
+// VIEW_COURSES only holds the shared table lock.
+#define CATALOG_CHUNK_CAPACITY (RESPONSE_CHUNK_SIZE + RESPONSE_CHUNK_SIZE / 4)  // room for counts to widen
+
+typedef struct CatalogChunk {
+    int refs;                       // the cache's, if current, and each response's
+    size_t len;
+    size_t capacity;
+    struct CatalogCache* cache;     // whose spare list it returns to
+    struct CatalogChunk* next;      // on the spare list
+    char text[];
+} CatalogChunk;
+
+typedef struct {
+    int course;         // position in courses
+    int enrolled;       // seat counts the row shows
+    int total;
+    int chunk;          // chunk holding the row
+    size_t seats;       // offset and length of the seat counts in the chunk
+    size_t seatsLen;
+} CatalogRow;
+
+typedef struct CatalogCache {
+    int student;                    // student listing (free seats) or admin listing
+    pthread_mutex_t lock;
+    unsigned long version;          // catalog_version it was rendered at, 0 for none
+    unsigned long seatsVersion;     // catalog_seats_version its counts were read at
+    CatalogChunk** chunks;          // the listing, in order
+    int* firstRow;                  // first row of each chunk
+    int chunkCount, chunkCapacity;
+    CatalogRow* rows;
+    int count, rowCapacity;
+    int* rowOf;                     // row of each position in courses, -1 for none
+    int rowOfSize;
+    CatalogChunk* spare;            // chunks no response holds, pushed without the mutex
+    unsigned long renders, patches, copies, hits;
+} CatalogCache;
+
+static CatalogCache adminCatalog = { .student = 0, .lock = PTHREAD_MUTEX_INITIALIZER };
+static CatalogCache studentCatalog = { .student = 1, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Drop a reference to a chunk. The last one puts it on its cache's spare
+// list, which is a lock-free stack, since responses let go of chunks once
+// written, without the cache's mutex.
+static void releaseCatalogChunk(void* owner) {
+    CatalogChunk* chunk = (CatalogChunk*)owner;
+    if (__atomic_sub_fetch(&chunk->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+    CatalogCache* cache = chunk->cache;
+    chunk->next = __atomic_load_n(&cache->spare, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&cache->spare, &chunk->next, chunk, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// An empty chunk with room for at least size bytes, preferably a spare one.
+// Only the mutex holder takes spare chunks, so popping them is safe.
+static CatalogChunk* newCatalogChunk(CatalogCache* cache, size_t size) {
+    CatalogChunk* chunk = __atomic_load_n(&cache->spare, __ATOMIC_ACQUIRE);
+    while (chunk && !__atomic_compare_exchange_n(&cache->spare, &chunk, chunk->next, 1,
+                                                 __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+    if (chunk && chunk->capacity < size) {
+        free(chunk);
+        chunk = NULL;
+    }
+    if (!chunk) {
+        size_t capacity = size > CATALOG_CHUNK_CAPACITY ? size : CATALOG_CHUNK_CAPACITY;
+        chunk = (CatalogChunk*)countedRealloc(NULL, sizeof(CatalogChunk) + capacity);
+        chunk->capacity = capacity;
+        chunk->cache = cache;
+    }
+    chunk->refs = 1;
+    chunk->len = 0;
+    return chunk;
+}
+
+// Start a new chunk at the end of the listing
+static CatalogChunk* addCatalogChunk(CatalogCache* cache, size_t size) {
+    if (cache->chunkCount == cache->chunkCapacity) {
+        cache->chunkCapacity = cache->chunkCapacity ? cache->chunkCapacity * 2 : 16;
+        cache->chunks = (CatalogChunk**)countedRealloc(cache->chunks, cache->chunkCapacity * sizeof(CatalogChunk*));
+        cache->firstRow = (int*)countedRealloc(cache->firstRow, cache->chunkCapacity * sizeof(int));
+    }
+    CatalogChunk* chunk = newCatalogChunk(cache, size);
+    cache->chunks[cache->chunkCount] = chunk;
+    cache->firstRow[cache->chunkCount] = cache->count;
+    cache->chunkCount++;
+    return chunk;
+}
+
+// Append formatted text to the listing, starting a new chunk if the last one
+// would grow past RESPONSE_CHUNK_SIZE. Returns the chunk it went into.
+static CatalogChunk* catalogPrintf(CatalogCache* cache, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    CatalogChunk* chunk = cache->chunkCount ? cache->chunks[cache->chunkCount - 1] : NULL;
+    if (!chunk || (chunk->len > 0 && chunk->len + n > RESPONSE_CHUNK_SIZE) || chunk->len + n + 1 > chunk->capacity) {
+        chunk = addCatalogChunk(cache, n + 1);
+    }
+    va_start(args, format);
+    vsnprintf(chunk->text + chunk->len, n + 1, format, args);
+    va_end(args);
+    chunk->len += n;
+    return chunk;
+}
+
+// Seat counts as a row shows them
+static int formatSeats(const CatalogCache* cache, int enrolled, int total, char* out, size_t size) {
+    return snprintf(out, size, "%d/%d", cache->student ? total - enrolled : enrolled, total);
+}
+
+// Render the listing from scratch
+static void renderCatalog(CatalogCache* cache) {
+    for (int i = 0; i < cache->chunkCount; i++) releaseCatalogChunk(cache->chunks[i]);
+    cache->chunkCount = 0;
+    cache->count = 0;
+    if (cache->rowOfSize < courses_size) {
+        cache->rowOf = (int*)countedRealloc(cache->rowOf, courses_size * sizeof(int));
+    }
+    cache->rowOfSize = courses_size;
+    catalogPrintf(cache, cache->student ? "Available courses:\n" : "Courses list:\n");
+    for (int i = 0; i < courses_size; i++) {
+        Course* course = &courses[i];
+        cache->rowOf[i] = -1;
+        if (!course->id) continue;
+        User* faculty = findUserById(course->facultyId);
+        const char* facultyName = faculty ? stringAt(faculty->username) : "Unknown";
+        if (cache->count == cache->rowCapacity) {
+            cache->rowCapacity = cache->rowCapacity ? cache->rowCapacity * 2 : 64;
+            cache->rows = (CatalogRow*)countedRealloc(cache->rows, cache->rowCapacity * sizeof(CatalogRow));
+        }
+        CatalogRow* row = &cache->rows[cache->count];
+        row->course = i;
+        row->enrolled = __atomic_load_n(&course->enrolledStudents, __ATOMIC_ACQUIRE);
+        row->total = course->totalSeats;
+        char seats[32];
+        row->seatsLen = formatSeats(cache, row->enrolled, row->total, seats, sizeof(seats));
+        CatalogChunk* chunk;
+        if (cache->student) {
+            chunk = catalogPrintf(cache, "Code: %s, Name: %s, Faculty: %s, Available seats: %s\n",
+                                  stringAt(course->code), stringAt(course->name), facultyName, seats);
+        } else {
+            chunk = catalogPrintf(cache, "ID: %d, Code: %s, Name: %s, Faculty: %s, Seats: %s\n",
+                                  course->id, stringAt(course->code), stringAt(course->name), facultyName, seats);
+        }
+        row->chunk = cache->chunkCount - 1;
+        row->seats = chunk->len - row->seatsLen - 1;
+        cache->rowOf[i] = cache->count++;
+    }
+    cache->renders++;
+}
+
+// Rewrite one row's seat counts if its course's differ, in a private copy of
+// its chunk if a response holds that. Returns 0 if the chunk has no room
+// left for the wider counts.
+static int patchCatalogRow(CatalogCache* cache, int r) {
+    CatalogRow* row = &cache->rows[r];
+    Course* course = &courses[row->course];
+    int enrolled = __atomic_load_n(&course->enrolledStudents, __ATOMIC_ACQUIRE);
+    if (enrolled == row->enrolled && course->totalSeats == row->total) return 1;
+    char seats[32];
+    size_t len = formatSeats(cache, enrolled, course->totalSeats, seats, sizeof(seats));
+    CatalogChunk* chunk = cache->chunks[row->chunk];
+    if (chunk->len + len - row->seatsLen > chunk->capacity) return 0;
+
+    if (__atomic_load_n(&chunk->refs, __ATOMIC_ACQUIRE) > 1) {
+        // Responses only take references under the mutex, so with none but
+        // the cache's the chunk can be changed where it is
+        CatalogChunk* copy = newCatalogChunk(cache, chunk->capacity);
+        memcpy(copy->text, chunk->text, chunk->len);
+        copy->len = chunk->len;
+        releaseCatalogChunk(chunk);
+        cache->chunks[row->chunk] = chunk = copy;
+        cache->copies++;
+    }
+    if (len != row->seatsLen) {
+        char* tail = chunk->text + row->seats + row->seatsLen;
+        memmove(chunk->text + row->seats + len, tail, chunk->text + chunk->len - tail);
+        chunk->len = chunk->len + len - row->seatsLen;
+        int end = row->chunk + 1 < cache->chunkCount ? cache->firstRow[row->chunk + 1] : cache->count;
+        for (int i = r + 1; i < end; i++) {
+            cache->rows[i].seats += len - row->seatsLen;   // wraps around when the text shrinks
+        }
+        row->seatsLen = len;
+    }
+    memcpy(chunk->text + row->seats, seats, len);
+    row->enrolled = enrolled;
+    row->total = course->totalSeats;
+    cache->patches++;
+    return 1;
+}
+
+// Bring the seat counts up to catalog_seats_version seatsVersion: the rows of
+// the courses logged since the cache's counts were read, or every row whose
+// counts changed if the log no longer holds all of those entries. Returns 0
+// if the listing has to be rendered again.
+static int patchCatalog(CatalogCache* cache, unsigned long seatsVersion) {
+    unsigned long seq = cache->seatsVersion;
+    if (seatsVersion - seq <= SEAT_LOG_SIZE) {
+        for (; seq != seatsVersion; seq++) {
+            uint64_t entry = __atomic_load_n(&seat_log[seq & (SEAT_LOG_SIZE - 1)], __ATOMIC_ACQUIRE);
+            if ((uint32_t)(entry >> 32) != (uint32_t)seq) break;   // overwritten, or not written yet
+            uint32_t position = (uint32_t)entry;
+            if (position >= (uint32_t)cache->rowOfSize || cache->rowOf[position] < 0) continue;
+            if (!patchCatalogRow(cache, cache->rowOf[position])) return 0;
+        }
+        if (seq == seatsVersion) return 1;
+    }
+    for (int i = 0; i < cache->count; i++) {
+        if (!patchCatalogRow(cache, i)) return 0;
+    }
+    return 1;
+}
+
+// Send a VIEW_COURSES listing, bringing the cached text up to date first.
+// Needs the table lock (shared is enough). The chunks are attached to the
+// response, so nothing is copied and nothing written under the mutex.
+static void writeCatalog(CatalogCache* cache, Response* res) {
+    pthread_mutex_lock(&cache->lock);
+    unsigned long version = __atomic_load_n(&catalog_version, __ATOMIC_RELAXED);
+    // Read before the counts, so a change made while patching is seen next time
+    unsigned long seatsVersion = __atomic_load_n(&catalog_seats_version, __ATOMIC_ACQUIRE);
+    if (cache->version == version && cache->seatsVersion == seatsVersion) {
+        cache->hits++;
+    } else {
+        if (cache->version != version || !patchCatalog(cache, seatsVersion)) {
+            renderCatalog(cache);
+        }
+        cache->version = version;
+        cache->seatsVersion = seatsVersion;
+    }
+    for (int i = 0; i < cache->chunkCount; i++) {
+        CatalogChunk* chunk = cache->chunks[i];
+        __atomic_add_fetch(&chunk->refs, 1, __ATOMIC_RELAXED);
+        responseAttach(res, chunk->text, chunk->len, releaseCatalogChunk, chunk);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+static void adminViewCourses(User* admin, Command* cmd, Response* res) {
+    writeCatalog(&adminCatalog, res);
+}
+
+// Add the users of an import parsed by prepareImport(). Rows with a username
+// that is taken, earlier in the import or before it, are reported and
+// skipped. The arrays grow once and the changes are persisted once.
+void importUsers(const PreparedImport* import, Response* res) {
+    // Timed from when its rows began to be parsed and hashed
+    struct timespec start = prepared.started;
+    if (!prepared.active) clock_gettime(CLOCK_MONOTONIC, &start);
+    reserveUsers(import->count);
+
+    // Collect the records in a batch, unless this already runs inside one
+    Batch batch;
+    Batch* outer = active_batch;
+    if (!outer) {
+        memset(&batch, 0, sizeof(batch));
+        active_batch = &batch;
+    }
+
+    int nextId = users_size ? users[users_size-1].id + 1 : 1;
+    int firstId = nextId;
+    int imported = 0, duplicates = 0, invalid = 0;
+    for (int i = import->first; i < import->first + import->count; i++) {
+        const ImportRow* row = &prepared.rows[i];
+        char username[MAX_STR], password[MAX_STR];
+        User user;
+        user.type = row->type;
+        if (row->type) {
+            snprintf(username, sizeof(username), "%.*s", row->usernameLen, row->username);
+            snprintf(password, sizeof(password), "%.*s", row->passwordLen, row->password);
+        }
+        if (!row->type) {
+            if (invalid++ < 10) responsePrintf(res, "Line %d: invalid row\n", row->line);
+        } else if (findUserByUsername(username)) {
+            if (duplicates++ < 10) responsePrintf(res, "Line %d: username %s already exists\n", row->line, username);
+        } else if (!setPassword(&user.password, password)) {
+            if (invalid++ < 10) responsePrintf(res, "Line %d: password could not be hashed\n", row->line);
+        } else {
+            user.id = nextId++;
+            user.username = internString(username);
+            user.active = 1;
+            persistUser(appendUser(&user));
+            imported++;
+        }
+    }
+
+    if (!outer) {
+        active_batch = NULL;
+        commitBatch(&batch);
+        free(batch.records);
+    }
+
+    double ms = elapsedMs(&start);
+    if (imported) {
+        responsePrintf(res, "Imported %d users (IDs %d-%d)", imported, firstId, nextId - 1);
+    } else {
+        responsePuts(res, "Imported 0 users");
+    }
+    responsePrintf(res, ", skipped %d duplicates and %d invalid rows in %.1f ms (%.0f rows/s)",
+                   duplicates, invalid, ms, ms > 0 ? (imported + duplicates + invalid) * 1000.0 / ms : 0.0);
+}
+
+static void studentEnroll(User* student, Command* cmd, Response* res) {
+    Course* course = findCourseByCode(cmd->args[0]);
+    if (!course) {
+        responsePuts(res, "Course not found");
+        return;
+    }
+    if (isEnrolled(student->id, course->id)) {
+        responsePuts(res, "Already enrolled in this course");
+        return;
+    }
+    // Seats freed while students are waiting go to the waitlist first
+    if (__atomic_load_n(&courseWaitlists[course - courses].size, __ATOMIC_ACQUIRE) > 0 ||
+        !reserveSeat(course)) {
+        responsePuts(res, "Course is full");
+        return;
+    }
+    if (!enrollStudent(student->id, course->id)) {
+        // Lost a race with a concurrent ENROLL by the same student
+        releaseSeat(course);
+        responsePuts(res, "Already enrolled in this course");
+        return;
+    }
+    responsePrintf(res, "Successfully enrolled in %s - %s", stringAt(course->code), stringAt(course->name));
+}
+
+static void studentUnenroll(User* student, Command* cmd, Response* res) {
+    Course* course = findCourseByCode(cmd->args[0]);
+    if (!course) {
+        responsePuts(res, "Course not found");
+        return;
+    }
+    if (!unenrollStudent(student->id, course->id)) {
+        responsePuts(res, "Not enrolled in this course");
+        return;
+    }
+    releaseSeat(course);
+    promoteWaitlist(course);
+    responsePrintf(res, "Successfully unenrolled from %s - %s", stringAt(course->code), stringAt(course->name));
+}
+
+static void studentWaitlist(User* student, Command* cmd, Response* res) {
+    Course* course = findCourseByCode(cmd->args[0]);
+    if (!course) {
+        responsePuts(res, "Course not found");
+        return;
+    }
+    int position = waitlistPosition(student->id, course->id);
+    if (position) {
+        responsePrintf(res, "Already on the waitlist for %s at position %d", stringAt(course->code), position);
+        return;
+    }
+    position = joinWaitlist(student->id, course->id);
+    if (!position) {
+        responsePuts(res, "Already enrolled in this course");
+        return;
+    }
+    // A seat may be free already, e.g. if the queue was empty
+    promoteWaitlist(course);
+    if (isEnrolled(student->id, course->id)) {
+        responsePrintf(res, "Successfully enrolled in %s - %s", stringAt(course->code), stringAt(course->name));
+    } else {
+        responsePrintf(res, "Added to the waitlist for %s at position %d",
+                       stringAt(course->code), waitlistPosition(student->id, course->id));
+    }
+}
+
+static void studentLeaveWaitlist(User* student, Command* cmd, Response* res) {
+    Course* course = findCourseByCode(cmd->args[0]);
+    if (!course) {
+        responsePuts(res, "Course not found");
+        return;
+    }
+    if (!leaveWaitlist(student->id, course->id)) {
+        responsePuts(res, "Not on the waitlist for this course");
+        return;
+    }
+    responsePrintf(res, "Left the waitlist for %s", stringAt(course->code));
+}
+
+static void studentViewWaitlist(User* student, Command* cmd, Response* res) {
+    int waiting = 0;
+    for (int i = 0; i < courses_size; i++) {
+        if (!courses[i].id) continue;
+        lockCourse(courses[i].id);
+        int position = waitlistPosition(student->id, courses[i].id);
+        int size = courseWaitlists[i].size;
+        unlockCourse(courses[i].id);
+        if (position) {
+            if (!waiting) responsePuts(res, "Waitlisted courses:\n");
+            responsePrintf(res, "Code: %s, Name: %s, Position: %d of %d\n", stringAt(courses[i].code),
+                           stringAt(courses[i].name), position, size);
+            waiting = 1;
+        }
+    }
+    if (!waiting) {
+        responsePuts(res, "You are not on any waitlist");
+    }
+}
+
+static void studentViewEnrolled(User* student, Command* cmd, Response* res) {
+    pthread_mutex_lock(&enrollment_lock);
+    int hasEnrollments = 0;
+    IdList* enrolled = &studentCourses[student - users];
+    for (int i = 0; i < enrolled->size; i++) {
+        Course* course = findCourseById(enrolled->ids[i]);
+        if (course) {
+            if (!hasEnrollments) responsePuts(res, "Enrolled courses:\n");
+            responsePrintf(res, "Code: %s, Name: %s\n", stringAt(course->code), stringAt(course->name));
+            hasEnrollments = 1;
+        }
+    }
+    pthread_mutex_unlock(&enrollment_lock);
+    if (!hasEnrollments) {
+        responsePuts(res, "You are not enrolled in any courses");
+    }
+}
+
+static void studentViewCourses(User* student, Command* cmd, Response* res) {
+    writeCatalog(&studentCatalog, res);
+}
+
+// CHANGE_PASSWORD <old> <new>, for students and faculty
+static void changePassword(User* user, Command* cmd, Response* res) {
+    char* oldPassword = cmd->args[0];
+    char* newPassword = cmd->args[1];
+    if (!checkCurrentPassword(user, oldPassword)) {
+        responsePuts(res, "Incorrect current password");
+        return;
+    }
+    undoUser(user);
+    if (!setPassword(&user->password, newPassword)) {
+        responsePuts(res, "Password could not be hashed");
+        return;
+    }
+    persistUser(user);
+    responsePuts(res, "Password changed successfully");
+}
+
+static void facultyAddCourse(User* faculty, Command* cmd, Response* res) {
+    char* courseCode = cmd->args[0];
+    char* courseName = cmd->text;
+    int seats = atoi(cmd->args[1]);
+    if (findCourseByCode(courseCode)) {
+        responsePrintf(res, "Course with code %s already exists", courseCode);
+        return;
+    }
+    Course course;
+    course.id = last_course_id + 1;
+    course.code = internString(courseCode);
+    course.name = internString(courseName);
+    course.facultyId = faculty->id;
+    course.totalSeats = seats;
+    course.enrolledStudents = 0;
+    addCourse(&course);
+    persistCourse(&course);
+    responsePrintf(res, "Course added successfully: %s - %s", courseCode, courseName);
+}
+
+static void facultyRemoveCourse(User* faculty, Command* cmd, Response* res) {
+    char* courseCode = cmd->args[0];
+    int courseId = -1;
+    Course* course = findCourseByCode(courseCode);
+    if (course && course->facultyId == faculty->id) {
+        courseId = course->id;
+        removeCourseEnrollments(courseId);
+        removeCourseAt(course - courses);
+    }
+    if (courseId == -1) {
+        responsePuts(res, "Course not found or you don't have permission to remove it");
+        return;
+    }
+    persistCourseRemoval(courseId);
+    responsePrintf(res, "Course %s removed successfully", courseCode);
+}
+
+static void facultyUpdateSeats(User* faculty, Command* cmd, Response* res) {
+    Course* course = findCourseByCode(cmd->args[0]);
+    if (!course || course->facultyId != faculty->id) {
+        responsePuts(res, "Course not found or you don't have permission to change it");
+        return;
+    }
+    int seats = atoi(cmd->args[1]);
+    if (seats < course->enrolledStudents) {
+        responsePrintf(res, "%d students are enrolled; seats cannot go below that", course->enrolledStudents);
+        return;
+    }
+    undoSeats(course, course->enrolledStudents);
+    course->totalSeats = seats;
+    catalogSeatsChanged(course);
+    persistCourse(course);
+    int promoted = promoteWaitlist(course);
+    responsePrintf(res, "Course %s now has %d seats (%d promoted from the waitlist)",
+                   stringAt(course->code), seats, promoted);
+}
+
+static void facultyViewEnrollments(User* faculty, Command* cmd, Response* res) {
+    int hasCourses = 0;
+    for (int i = 0; i < courses_size; i++) {
+        if (courses[i].facultyId == faculty->id) {
+            lockCourse(courses[i].id);
+            if (!hasCourses) responsePuts(res, "Course enrollments:\n");
+            responsePrintf(res, "\nCourse: %s - %s\nEnrolled students: %d/%d\n", 
+                           stringAt(courses[i].code), stringAt(courses[i].name), 
+                           courses[i].enrolledStudents, courses[i].totalSeats);
+            int hasStudents = 0;
+            IdList* roster = &courseStudents[i];
+            for (int j = 0; j < roster->size; j++) {
+                User* student = findUserById(roster->ids[j]);
+                if (student) {
+                    responsePrintf(res, "- %s (ID: %d)\n", stringAt(student->username), student->id);
+                    hasStudents = 1;
+                }
+            }
+            if (!hasStudents) {
+                responsePuts(res, "- No students enrolled yet\n");
+            }
+            if (courseWaitlists[i].size > 0) {
+                responsePrintf(res, "Waitlist: %d students\n", courseWaitlists[i].size);
+            }
+            unlockCourse(courses[i].id);
+            hasCourses = 1;
+        }
+    }
+    if (!hasCourses) {
+        responsePuts(res, "You have not offered any courses");
+    }
+}
+
+static void facultyViewCourses(User* faculty, Command* cmd, Response* res) {
+    int hasCourses = 0;
+    for (int i = 0; i < courses_size; i++) {
+        if (courses[i].facultyId == faculty->id) {
+            if (!hasCourses) responsePuts(res, "Your courses:\n");
+            responsePrintf(res, "Code: %s, Name: %s, Enrollment: %d/%d\n", 
+                           stringAt(courses[i].code), stringAt(courses[i].name), 
+                           courses[i].enrolledStudents, courses[i].totalSeats);
+            hasCourses = 1;
+        }
+    }
+    if (!hasCourses) {
+        responsePuts(res, "You have not offered any courses");
+    }
+}
+
+// Commands of each role. arity is the number of words a command needs after
+// its verb; missing ones are reported before the handler runs.
+static const CommandSpec commandSpecs[] = {
+    { ADMIN, "ADD_STUDENT", 2, COMMAND_STRUCTURAL | COMMAND_PASSWORD, adminAddStudent },
+    { ADMIN, "ADD_FACULTY", 2, COMMAND_STRUCTURAL | COMMAND_PASSWORD, adminAddFaculty },
+    { ADMIN, "TOGGLE_STUDENT", 1, COMMAND_STRUCTURAL, adminToggleStudent },
+    { ADMIN, "UPDATE_USER", 3, COMMAND_STRUCTURAL | COMMAND_PASSWORD, adminUpdateUser },
+    { ADMIN, "IMPORT_USERS", 0, COMMAND_STRUCTURAL | COMMAND_PASSWORD, adminImportUsers },
+    { ADMIN, "VIEW_USERS", 0, COMMAND_READ_ONLY, adminViewUsers },
+    { ADMIN, "VIEW_COURSES", 0, COMMAND_READ_ONLY, adminViewCourses },
+    { ADMIN, "BGSAVE", 0, 0, adminBgsave },
+    { ADMIN, "MEMORY", 0, COMMAND_READ_ONLY, adminMemory },
+    { ADMIN, "STATS", 0, COMMAND_READ_ONLY, adminStats },
+    { STUDENT, "ENROLL", 1, 0, studentEnroll },
+    { STUDENT, "UNENROLL", 1, 0, studentUnenroll },
+    { STUDENT, "WAITLIST", 1, 0, studentWaitlist },
+    { STUDENT, "LEAVE_WAITLIST", 1, 0, studentLeaveWaitlist },
+    { STUDENT, "VIEW_WAITLIST", 0, COMMAND_READ_ONLY, studentViewWaitlist },
+    { STUDENT, "VIEW_ENROLLED", 0, COMMAND_READ_ONLY, studentViewEnrolled },
+    { STUDENT, "VIEW_COURSES", 0, COMMAND_READ_ONLY, studentViewCourses },
+    { STUDENT, "CHANGE_PASSWORD", 2, COMMAND_STRUCTURAL | COMMAND_PASSWORD, changePassword },
+    { FACULTY, "ADD_COURSE", 2, COMMAND_STRUCTURAL | COMMAND_TEXT, facultyAddCourse },
+    { FACULTY, "REMOVE_COURSE", 1, COMMAND_STRUCTURAL, facultyRemoveCourse },
+    { FACULTY, "UPDATE_SEATS", 2, COMMAND_STRUCTURAL, facultyUpdateSeats },
+    { FACULTY, "VIEW_ENROLLMENTS", 0, COMMAND_READ_ONLY, facultyViewEnrollments },
+    { FACULTY, "VIEW_COURSES", 0, COMMAND_READ_ONLY, facultyViewCourses },
+    { FACULTY, "CHANGE_PASSWORD", 2, COMMAND_STRUCTURAL | COMMAND_PASSWORD, changePassword },
+};
+
+// Perfect hash table over (role, verb): initCommandTable() picks a seed under
+// which no two commands share a slot, so a lookup is one hash and one compare
+static const CommandSpec* commandTable[COMMAND_TABLE_SIZE];
+static unsigned int commandSeed;
+
+static unsigned int commandSlot(enum UserType role, const char* verb, size_t len, unsigned int seed) {
+    unsigned int hash = seed ^ (unsigned int)role;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)verb[i];
+        hash *= 16777619u;
+    }
+    hash ^= hash >> 16;
+    return hash & (COMMAND_TABLE_SIZE - 1);
+}
+
+void initCommandTable() {
+    size_t count = sizeof(commandSpecs) / sizeof(commandSpecs[0]);
+    if (count > MAX_COMMANDS) {
+        fprintf(stderr, "Too many commands for MAX_COMMANDS\n");
+        exit(1);
+    }
+    for (unsigned int seed = 2166136261u; ; seed++) {
+        memset(commandTable, 0, sizeof(commandTable));
+        size_t placed = 0;
+        while (placed < count) {
+            const CommandSpec* spec = &commandSpecs[placed];
+            unsigned int slot = commandSlot(spec->role, spec->verb, strlen(spec->verb), seed);
+            if (commandTable[slot]) break;
+            commandTable[slot] = spec;
+            placed++;
+        }
+        if (placed == count) {
+            commandSeed = seed;
+            return;
+        }
+    }
+}
+
+// Command of a role with the given verb (not necessarily NUL-terminated)
+static const CommandSpec* findCommand(enum UserType role, const char* verb, size_t len) {
+    const CommandSpec* spec = commandTable[commandSlot(role, verb, len, commandSeed)];
+    if (spec && spec->role == role && strncmp(spec->verb, verb, len) == 0 && spec->verb[len] == '\0') {
+        return spec;
+    }
+    return NULL;
+}
+
+// Flags of the command a request starts with, without modifying it; 0 if
+// the role has no such command
+int commandFlags(enum UserType role, const char* request) {
+    const char* verb = request + strspn(request, WORD_DELIMITERS);
+    const CommandSpec* spec = findCommand(role, verb, strcspn(verb, WORD_DELIMITERS));
+    return spec ? spec->flags : 0;
+}
+
+// Split a command of the user's role in place and run its handler
+void dispatchCommand(User* user, char* request, Response* res) {
+    static const char* roleNames[] = { "", "admin", "student", "faculty" };
+    Command cmd;
+    char* cursor = request;
+    size_t len;
+    cmd.verb = nextWord(&cursor, &len);
+    if (!cmd.verb) {
+        countRejected();
+        responsePrintf(res, "Invalid %s request", roleNames[user->type]);
+        return;
+    }
+    const CommandSpec* spec = findCommand(user->type, cmd.verb, len);
+    if (!spec) {
+        countRejected();
+        responsePrintf(res, "Invalid %s command", roleNames[user->type]);
+        return;
+    }
+    for (int i = 0; i < spec->arity; i++) {
+        cmd.args[i] = nextWord(&cursor, NULL);
+        if (!cmd.args[i]) {
+            countRejected();
+            responsePuts(res, "Invalid format");
+            return;
+        }
+    }
+    cmd.text = cursor + strspn(cursor, WORD_DELIMITERS);
+    if (!*cmd.text) cmd.text = NULL;
+    if ((spec->flags & COMMAND_TEXT) && !cmd.text) {
+        countRejected();
+        responsePuts(res, "Invalid format");
+        return;
+    }
+    if (!active_batch) request_kind = spec - commandSpecs;
+    spec->handler(user, &cmd, res);
+}
+
+// Sum the statistics of every thread into total
+static void sumThreadStats(ThreadStats* total) {
+    memset(total, 0, sizeof(*total));
+    pthread_mutex_lock(&stats_lock);
+    for (ThreadStats* stats = thread_stats_list; stats; stats = stats->next) {
+        for (int kind = 0; kind < STAT_KINDS; kind++) {
+            Histogram* from = &stats->commands[kind];
+            Histogram* to = &total->commands[kind];
+            for (int i = 0; i < LATENCY_BUCKETS; i++) {
+                to->buckets[i] += __atomic_load_n(&from->buckets[i], __ATOMIC_RELAXED);
+            }
+            to->count += __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+            to->total_us += __atomic_load_n(&from->total_us, __ATOMIC_RELAXED);
+        }
+        total->rejected += __atomic_load_n(&stats->rejected, __ATOMIC_RELAXED);
+        total->lock_waits += __atomic_load_n(&stats->lock_waits, __ATOMIC_RELAXED);
+        total->lock_wait_us += __atomic_load_n(&stats->lock_wait_us, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+// Upper bound in milliseconds of the bucket holding the given fraction of
+// a histogram's samples
+static double histogramPercentile(const Histogram* histogram, double fraction) {
+    uint64_t rank = (uint64_t)(fraction * histogram->count);
+    uint64_t seen = 0;
+    int bucket = 0;
+    for (; bucket < LATENCY_BUCKETS - 1; bucket++) {
+        seen += histogram->buckets[bucket];
+        if (seen > rank) break;
+    }
+    return (double)(1ull << bucket) / 1000.0;
+}
+
+// Name of a request kind, as "<ROLE> <VERB>"
+static void statKindName(int kind, char* buffer, size_t size) {
+    static const char* roleNames[] = { "", "ADMIN", "STUDENT", "FACULTY" };
+    if (kind == STAT_LOGIN) {
+        snprintf(buffer, size, "LOGIN");
+    } else if (kind == STAT_BATCH) {
+        snprintf(buffer, size, "BATCH");
+    } else if (kind == STAT_OTHER) {
+        snprintf(buffer, size, "(unknown)");
+    } else {
+        snprintf(buffer, size, "%s %s", roleNames[commandSpecs[kind].role], commandSpecs[kind].verb);
+    }
+}
+
+static void printHistogram(Response* res, const char* name, const Histogram* histogram) {
+    double total = histogram->total_us / 1000.0;
+    responsePrintf(res, "%s: %llu, avg %.3f ms, p50 < %.3f ms, p99 < %.3f ms, total %.1f ms\n", name,
+                   (unsigned long long)histogram->count,
+                   histogram->count ? total / histogram->count : 0.0,
+                   histogramPercentile(histogram, 0.5), histogramPercentile(histogram, 0.99), total);
+}
+
+// Live server statistics for ADMIN STATS. Latency buckets are printed as
+// "<upper bound in ms>:<count>" for the non-empty ones.
+void writeStats(Response* res) {
+    ThreadStats total;
+    sumThreadStats(&total);
+    uint64_t requests = 0;
+    for (int kind = 0; kind < STAT_KINDS; kind++) requests += total.commands[kind].count;
+
+    responsePrintf(res, "Connections: %d active, %lu accepted\n",
+                   __atomic_load_n(&active_connections, __ATOMIC_RELAXED),
+                   __atomic_load_n(&accepted_connections, __ATOMIC_RELAXED));
+    responsePrintf(res, "Data: %d users, %d courses, %d enrollments\n",
+                   users_size, courses_size - freeCourseSlots.size,
+                   enrollments_size - freeEnrollmentSlots.size);
+    responsePrintf(res, "Tombstones: %d courses, %d enrollments, %lu compactions\n",
+                   freeCourseSlots.size, freeEnrollmentSlots.size, compactions);
+    CatalogCache* catalogs[] = { &adminCatalog, &studentCatalog };
+    unsigned long renders = 0, patches = 0, copies = 0, hits = 0;
+    for (int i = 0; i < 2; i++) {
+        pthread_mutex_lock(&catalogs[i]->lock);
+        renders += catalogs[i]->renders;
+        patches += catalogs[i]->patches;
+        copies += catalogs[i]->copies;
+        hits += catalogs[i]->hits;
+        pthread_mutex_unlock(&catalogs[i]->lock);
+    }
+    responsePrintf(res, "Course catalog: version %lu, %lu renders, %lu rows patched, %lu chunks copied, %lu unchanged hits\n",
+                   __atomic_load_n(&catalog_version, __ATOMIC_RELAXED), renders, patches, copies, hits);
+    int plain = 0;
+    for (int i = 0; i < users_size; i++) {
+        if (!isPasswordHash(stringAt(users[i].password))) plain++;
+    }
+    pthread_mutex_lock(&auth_queue.lock);
+    int authQueued = auth_queue.count;
+    pthread_mutex_unlock(&auth_queue.lock);
+    responsePrintf(res, "Passwords: %d hashed, %d plain awaiting login; auth pool %d threads, %d queued\n",
+                   users_size - plain, plain, auth_threads, authQueued);
+    responsePrintf(res, "Requests: %llu, rejected %llu\n",
+                   (unsigned long long)requests, (unsigned long long)total.rejected);
+    for (int kind = 0; kind < STAT_KINDS; kind++) {
+        const Histogram* histogram = &total.commands[kind];
+        if (histogram->count == 0) continue;
+        char name[64];
+        statKindName(kind, name, sizeof(name));
+        printHistogram(res, name, histogram);
+        responsePuts(res, "  buckets");
+        for (int i = 0; i < LATENCY_BUCKETS; i++) {
+            if (histogram->buckets[i]) {
+                responsePrintf(res, " %g:%llu", (double)(1ull << i) / 1000.0,
+                               (unsigned long long)histogram->buckets[i]);
+            }
+        }
+        responsePuts(res, "\n");
+    }
+    Histogram saves = data_write_latency;
+    Histogram syncs = journal_sync_latency;
+    printHistogram(res, "Saves", &saves);
+    printHistogram(res, "Journal syncs", &syncs);
+    responsePrintf(res, "Lock waits: %llu, total %.1f ms",
+                   (unsigned long long)total.lock_waits, total.lock_wait_us / 1000.0);
+}
+
+// Write a histogram in the Prometheus text format, in seconds, with the
+// given labels ("" for none) on every series
+static void writeMetricHistogram(FILE* out, const char* name, const char* labels,
+                                 const Histogram* histogram) {
+    const char* sep = *labels ? "," : "";
+    uint64_t cumulative = 0;
+    for (int i = 0; i < LATENCY_BUCKETS - 1; i++) {
+        cumulative += histogram->buckets[i];
+        fprintf(out, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels, sep,
+                (double)(1ull << i) / 1e6, (unsigned long long)cumulative);
+    }
+    fprintf(out, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, sep,
+            (unsigned long long)histogram->count);
+    const char* open = *labels ? "{" : "";
+    const char* close = *labels ? "}" : "";
+    fprintf(out, "%s_sum%s%s%s %g\n", name, open, labels, close, histogram->total_us / 1e6);
+    fprintf(out, "%s_count%s%s%s %llu\n", name, open, labels, close, (unsigned long long)histogram->count);
+}
+
+// Bytes held by an index or by the adjacency lists of a table
+static size_t indexBytes(const HashIndex* index) {
+    return index->capacity * sizeof(int);
+}
+
+static size_t idListBytes(const IdList* lists, int count) {
+    size_t bytes = count * sizeof(IdList);
+    for (int i = 0; i < count; i++) bytes += lists[i].capacity * sizeof(int);
+    return bytes;
+}
+
+// Server metrics in the Prometheus text exposition format
+void writeMetrics(FILE* out) {
+    ThreadStats total;
+    sumThreadStats(&total);
+
+    fprintf(out, "# HELP coursereg_requests_total Requests handled, by command.\n"
+                 "# TYPE coursereg_requests_total counter\n");
+    for (int kind = 0; kind < STAT_KINDS; kind++) {
+        if (total.commands[kind].count == 0) continue;
+        char name[64];
+        statKindName(kind, name, sizeof(name));
+        fprintf(out, "coursereg_requests_total{command=\"%s\"} %llu\n", name,
+                (unsigned long long)total.commands[kind].count);
+    }
+    fprintf(out, "# HELP coursereg_request_errors_total Requests refused before reaching a command.\n"
+                 "# TYPE coursereg_request_errors_total counter\n"
+                 "coursereg_request_errors_total %llu\n", (unsigned long long)total.rejected);
+    fprintf(out, "# HELP coursereg_request_duration_seconds Request latency, by command.\n"
+                 "# TYPE coursereg_request_duration_seconds histogram\n");
+    for (int kind = 0; kind < STAT_KINDS; kind++) {
+        if (total.commands[kind].count == 0) continue;
+        char name[64], labels[80];
+        statKindName(kind, name, sizeof(name));
+        snprintf(labels, sizeof(labels), "command=\"%s\"", name);
+        writeMetricHistogram(out, "coursereg_request_duration_seconds", labels, &total.commands[kind]);
+    }
+
+    fprintf(out, "# HELP coursereg_connections Open client connections.\n"
+                 "# TYPE coursereg_connections gauge\n"
+                 "coursereg_connections %d\n", __atomic_load_n(&active_connections, __ATOMIC_RELAXED));
+    fprintf(out, "# HELP coursereg_connections_accepted_total Client connections accepted.\n"
+                 "# TYPE coursereg_connections_accepted_total counter\n"
+                 "coursereg_connections_accepted_total %lu\n",
+            __atomic_load_n(&accepted_connections, __ATOMIC_RELAXED));
+
+    Histogram saves = data_write_latency;
+    Histogram syncs = journal_sync_latency;
+    fprintf(out, "# HELP coursereg_save_duration_seconds Time taken to write the data files.\n"
+                 "# TYPE coursereg_save_duration_seconds histogram\n");
+    writeMetricHistogram(out, "coursereg_save_duration_seconds", "", &saves);
+    fprintf(out, "# HELP coursereg_journal_fsync_duration_seconds Time taken by journal group commit fsyncs.\n"
+                 "# TYPE coursereg_journal_fsync_duration_seconds histogram\n");
+    writeMetricHistogram(out, "coursereg_journal_fsync_duration_seconds", "", &syncs);
+    fprintf(out, "# HELP coursereg_lock_waits_total Table lock acquisitions that had to wait.\n"
+                 "# TYPE coursereg_lock_waits_total counter\n"
+                 "coursereg_lock_waits_total %llu\n"
+                 "# HELP coursereg_lock_wait_seconds_total Time spent waiting for the table lock.\n"
+                 "# TYPE coursereg_lock_wait_seconds_total counter\n"
+                 "coursereg_lock_wait_seconds_total %g\n",
+            (unsigned long long)total.lock_waits, total.lock_wait_us / 1e6);
+
+    // Queue depths
+    int queued = 0;
+    if (worker_threads) {
+        pthread_mutex_lock(&work_queue.lock);
+        queued = work_queue.count;
+        pthread_mutex_unlock(&work_queue.lock);
+    }
+    pthread_mutex_lock(&auth_queue.lock);
+    int authQueued = auth_queue.count;
+    pthread_mutex_unlock(&auth_queue.lock);
+    pthread_mutex_lock(&journal_lock);
+    unsigned long unsynced = journal_appended - journal_durable;
+    pthread_mutex_unlock(&journal_lock);
+    pthread_mutex_lock(&bgsave_lock);
+    int dirty = bgsave_dirty;
+    pthread_mutex_unlock(&bgsave_lock);
+
+    acquireReadLock();
+    long waitlisted = 0;
+    size_t waitlistBytes = courses_size * sizeof(IdQueue);
+    for (int i = 0; i < courses_size; i++) {
+        waitlisted += courseWaitlists[i].size;
+        waitlistBytes += courseWaitlists[i].capacity * sizeof(int);
+    }
+    fprintf(out, "# HELP coursereg_queue_depth Items waiting in the server's queues.\n"
+                 "# TYPE coursereg_queue_depth gauge\n"
+                 "coursereg_queue_depth{queue=\"workers\"} %d\n"
+                 "coursereg_queue_depth{queue=\"auth\"} %d\n"
+                 "coursereg_queue_depth{queue=\"journal\"} %lu\n"
+                 "coursereg_queue_depth{queue=\"bgsave\"} %d\n"
+                 "coursereg_queue_depth{queue=\"waitlists\"} %ld\n",
+            queued, authQueued, unsynced, dirty, waitlisted);
+
+    // Memory footprint of the tables: records, their indexes and lists
+    fprintf(out, "# HELP coursereg_records Records in each table.\n"
+                 "# TYPE coursereg_records gauge\n"
+                 "coursereg_records{table=\"users\"} %d\n"
+                 "coursereg_records{table=\"courses\"} %d\n"
+                 "coursereg_records{table=\"enrollments\"} %d\n",
+            users_size, courses_size - freeCourseSlots.size, enrollments_size - freeEnrollmentSlots.size);
+    fprintf(out, "# HELP coursereg_tombstones Removed records still holding a slot.\n"
+                 "# TYPE coursereg_tombstones gauge\n"
+                 "coursereg_tombstones{table=\"courses\"} %d\n"
+                 "coursereg_tombstones{table=\"enrollments\"} %d\n"
+                 "# HELP coursereg_compactions_total Compactions of the tables.\n"
+                 "# TYPE coursereg_compactions_total counter\n"
+                 "coursereg_compactions_total %lu\n",
+            freeCourseSlots.size, freeEnrollmentSlots.size, compactions);
+    fprintf(out, "# HELP coursereg_table_bytes Memory held by each table, its indexes and lists.\n"
+                 "# TYPE coursereg_table_bytes gauge\n"
+                 "coursereg_table_bytes{table=\"users\"} %zu\n"
+                 "coursereg_table_bytes{table=\"courses\"} %zu\n"
+                 "coursereg_table_bytes{table=\"enrollments\"} %zu\n"
+                 "coursereg_table_bytes{table=\"waitlists\"} %zu\n"
+                 "coursereg_table_bytes{table=\"strings\"} %zu\n",
+            users_size * sizeof(User) + indexBytes(&userIdIndex) + indexBytes(&usernameIndex),
+            courses_size * sizeof(Course) + indexBytes(&courseIdIndex) + indexBytes(&courseCodeIndex),
+            enrollments_size * sizeof(Enrollment) + indexBytes(&enrollmentIndex)
+                + idListBytes(studentCourses, users_size) + idListBytes(courseStudents, courses_size),
+            waitlistBytes, string_pool_cap + intern_capacity * sizeof(StringRef));
+    releaseLock();
+}
+
+// Serve the metrics over HTTP on the local metrics port, one scrape at a
+// time, so monitoring never competes with clients on PORT
+void* metricsServer(void* listen_socket) {
+    int server_fd = *(int*)listen_socket;
+    struct timeval timeout = { 2, 0 };
+    while (1) {
+        int fd = accept(server_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR) perror("Metrics accept failed");
+            continue;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        // Any request gets the metrics; read up to the end of its header
+        char request[BUFFER_SIZE];
+        size_t len = 0;
+        ssize_t n;
+        while (len < sizeof(request) - 1 && (n = read(fd, request + len, sizeof(request) - 1 - len)) > 0) {
+            len += n;
+            request[len] = '\0';
+            if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) break;
+        }
+
+        char* body = NULL;
+        size_t body_len = 0;
+        FILE* out = open_memstream(&body, &body_len);
+        writeMetrics(out);
+        fclose(out);
+        char header[128];
+        int header_len = snprintf(header, sizeof(header),
+                                  "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                  "Content-Length: %zu\r\n\r\n", body_len);
+        if (write(fd, header, header_len) == header_len) {
+            for (size_t sent = 0; sent < body_len; sent += n) {
+                n = write(fd, body + sent, body_len - sent);
+                if (n <= 0) break;
+            }
+        }
+        free(body);
+        close(fd);
+    }
+    return NULL;
+}
+
+// Hash an integer key (MurmurHash3 finalizer, so low bits are well mixed)
+unsigned int hashInt(int key) {
+    unsigned int hash = (unsigned int)key;
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+// Hash a string key (FNV-1a)
+unsigned int hashString(const char* s) {
+    unsigned int hash = 2166136261u;
+    while (*s) {
+        hash ^= (unsigned char)*s++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// String at an offset in the string pool
+const char* stringAt(StringRef ref) {
+    return string_pool + ref;
+}
+
+// Add a string to the intern set, which must have a free slot
+static void internInsert(StringRef ref) {
+    size_t mask = intern_capacity - 1;
+    size_t slot = hashString(string_pool + ref) & mask;
+    while (intern_slots[slot]) slot = (slot + 1) & mask;
+    intern_slots[slot] = ref;
+    intern_count++;
+}
+
+// Size the intern set for count strings and fill it from the pool
+static void resizeInternSet(size_t count) {
+    size_t capacity = 16;
+    while (capacity < count * 2) capacity *= 2;
+    free(intern_slots);
+    intern_slots = (StringRef*)countedRealloc(NULL, capacity * sizeof(StringRef));
+    memset(intern_slots, 0, capacity * sizeof(StringRef));
+    intern_capacity = capacity;
+    intern_count = 0;
+    for (size_t ref = 1; ref < string_pool_len; ref += strlen(string_pool + ref) + 1) {
+        internInsert(ref);
+    }
+}
+
+// Rebuild the intern set from the string pool, e.g. one loaded from a snapshot
+void rebuildStringIndex() {
+    size_t count = 0;
+    for (size_t ref = 1; ref < string_pool_len; ref += strlen(string_pool + ref) + 1) count++;
+    resizeInternSet(count);
+}
+
+// Offset of a string in the pool, adding it if it is not there yet. Strings
+// are cut to MAX_STR-1 bytes, like the fixed-size fields they replace.
+StringRef internString(const char* s) {
+    return internBytes(s, strlen(s));
+}
+
+// internString() for len bytes that need not be NUL-terminated
+StringRef internBytes(const char* s, size_t len) {
+    if (len >= MAX_STR) len = MAX_STR - 1;
+    if (len == 0) return 0;
+
+    if (2 * (intern_count + 1) > intern_capacity) resizeInternSet(intern_count + 1);
+    size_t mask = intern_capacity - 1;
+    unsigned int hash = 2166136261u;   // hashString() over the len bytes
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)s[i];
+        hash *= 16777619u;
+    }
+    size_t slot = hash & mask;
+    for (; intern_slots[slot]; slot = (slot + 1) & mask) {
+        const char* interned = string_pool + intern_slots[slot];
+        if (strncmp(interned, s, len) == 0 && interned[len] == '\0') return intern_slots[slot];
+    }
+
+    size_t needed = (string_pool_len ? string_pool_len : 1) + len + 1;
+    if (needed > string_pool_cap) {
+        size_t cap = string_pool_cap ? string_pool_cap * 2 : 4096;
+        while (cap < needed) cap *= 2;
+        string_pool = (char*)resizeArray(string_pool, string_pool_len, cap);
+        string_pool_cap = cap;
+    }
+    if (string_pool_len == 0) string_pool[string_pool_len++] = '\0';
+    StringRef ref = (StringRef)string_pool_len;
+    memcpy(string_pool + ref, s, len);
+    string_pool[ref + len] = '\0';
+    string_pool_len += len + 1;
+    intern_slots[slot] = ref;
+    intern_count++;
+    return ref;
+}
+
+unsigned int hashUserIdAt(int position) { return hashInt(users[position].id); }
+unsigned int hashUsernameAt(int position) { return hashString(stringAt(users[position].username)); }
+unsigned int hashCourseIdAt(int position) { return hashInt(courses[position].id); }
+unsigned int hashCourseCodeAt(int position) { return hashString(stringAt(courses[position].code)); }
+
+// Hash a (studentId, courseId) pair
+unsigned int hashEnrollment(int studentId, int courseId) {
+    return hashInt(studentId * 31 + hashInt(courseId));
+}
+
+unsigned int hashEnrollmentAt(int position) {
+    return hashEnrollment(enrollments[position].studentId, enrollments[position].courseId);
 }
 
-// Load all data from files
-void loadData() {
-    FILE* file;
-    char line[1024];
-    
-    // Load users
-    file = fopen(USER_FILE, "r");
-    if (file) {
-        while (fgets(line, sizeof(line), file)) {
-            User user;
-            char userType[20];
-            int active;
-            
-            // Parse user data
-            sscanf(line, "%d %s %s %s %d", &user.id, user.username, user.password, userType, &active);
-            
-            // Convert user type to enum
-            if (strcmp(userType, "ADMIN") == 0) user.type = ADMIN;
-            else if (strcmp(userType, "STUDENT") == 0) user.type = STUDENT;
-            else if (strcmp(userType, "FACULTY") == 0) user.type = FACULTY;
-            
-            user.active = active;
-            
-            // Add to users array
-            users = (User*)realloc(users, (users_size + 1) * sizeof(User));
-            users[users_size++] = user;
+// Drop all entries and size the index for the given number of records
+void indexReset(HashIndex* index, int records) {
+    int capacity = 16;
+    while (capacity < records * 2) capacity *= 2;
+    free(index->slots);
+    index->slots = (int*)countedRealloc(NULL, capacity * sizeof(int));
+    for (int i = 0; i < capacity; i++) index->slots[i] = INDEX_EMPTY;
+    index->capacity = capacity;
+    index->used = 0;
+}
+
+// Add the record at the given array position
+void indexInsert(HashIndex* index, int position) {
+    if (!index->slots) indexReset(index, 0);
+
+    // Keep the load factor (including deleted slots) at or below 1/2
+    if ((index->used + 1) * 2 > index->capacity) {
+        int* old = index->slots;
+        int old_capacity = index->capacity;
+        index->slots = NULL;
+        indexReset(index, old_capacity);
+        for (int i = 0; i < old_capacity; i++) {
+            if (old[i] >= 0) indexInsert(index, old[i]);
         }
-        fclose(file);
-    } else {
-        // Create default admin account if file doesn't exist
-        User admin;
-        admin.id = 1;
-        strcpy(admin.username, "admin");
-        strcpy(admin.password, "admin123");
-        admin.type = ADMIN;
-        admin.active = 1;
-        users = (User*)realloc(users, (users_size + 1) * sizeof(User));
-        users[users_size++] = admin;
+        free(old);
+    }
 
-        file = fopen(USER_FILE, "w");
-        fprintf(file, "%d %s %s ADMIN %d\n", admin.id, admin.username, admin.password, admin.active);
-        fclose(file);
+    unsigned int mask = index->capacity - 1;
+    unsigned int slot = index->hashAt(position) & mask;
+    while (index->slots[slot] >= 0) {
+        slot = (slot + 1) & mask;
     }
+    if (index->slots[slot] == INDEX_EMPTY) index->used++;
+    index->slots[slot] = position;
+}
 
-    // Load courses
-    file = fopen(COURSE_FILE, "r");
-    if (file) {
-        while (fgets(line, sizeof(line), file)) {
-            Course course;
-            char temp[1024];
-            // Parse course data
-            if (sscanf(line, "%d %s %d %d %d %[^\n]", &course.id, course.code, &course.facultyId, 
-                      &course.totalSeats, &course.enrolledStudents, temp) >= 5) {
-                strcpy(course.name, temp);
-                courses = (Course*)realloc(courses, (courses_size + 1) * sizeof(Course));
-                courses[courses_size++] = course;
-            }
+// Remove the record at the given array position. Must be called while the
+// record still holds the key it was inserted with.
+void indexRemove(HashIndex* index, int position) {
+    if (!index->slots) return;
+    unsigned int mask = index->capacity - 1;
+    unsigned int slot = index->hashAt(position) & mask;
+    while (index->slots[slot] != INDEX_EMPTY) {
+        if (index->slots[slot] == position) {
+            index->slots[slot] = INDEX_DELETED;
+            return;
         }
-        fclose(file);
+        slot = (slot + 1) & mask;
+    }
+}
+
+// Rebuild the user indexes from the users array
+void rebuildUserIndexes() {
+    indexReset(&userIdIndex, users_size);
+    indexReset(&usernameIndex, users_size);
+    for (int i = 0; i < users_size; i++) {
+        indexInsert(&userIdIndex, i);
+        indexInsert(&usernameIndex, i);
     }
+}
 
-    // Load enrollments
-    file = fopen(ENROLLMENT_FILE, "r");
-    if (file) {
-        while (fgets(line, sizeof(line), file)) {
-            Enrollment enrollment;
-            sscanf(line, "%d %d", &enrollment.studentId, &enrollment.courseId);
-            enrollments = (Enrollment*)realloc(enrollments, (enrollments_size + 1) * sizeof(Enrollment));
-            enrollments[enrollments_size++] = enrollment;
+// Rebuild the course indexes and free slot list from the courses array
+void rebuildCourseIndexes() {
+    indexReset(&courseIdIndex, courses_size);
+    indexReset(&courseCodeIndex, courses_size);
+    freeCourseSlots.size = 0;
+    for (int i = 0; i < courses_size; i++) {
+        if (!courses[i].id) {
+            idListAdd(&freeCourseSlots, i);
+            continue;
         }
-        fclose(file);
+        indexInsert(&courseIdIndex, i);
+        indexInsert(&courseCodeIndex, i);
+        if (courses[i].id > last_course_id) last_course_id = courses[i].id;
     }
 }
 
-// Save all data to files
-void saveData() {
-    sem_wait(&mutex);
+// Append a user and index it
+User* addUser(const User* user) {
+    reserveUsers(1);
+    return appendUser(user);
+}
 
-    // Save users
-    FILE* userFile = fopen(USER_FILE, "w");
-    for (int i = 0; i < users_size; i++) {
-        const char* userType = users[i].type == ADMIN ? "ADMIN" : 
-                             users[i].type == STUDENT ? "STUDENT" : "FACULTY";
-        fprintf(userFile, "%d %s %s %s %d\n", users[i].id, users[i].username, 
-                users[i].password, userType, users[i].active);
+// Make room for count more users, so a bulk insert grows the arrays once
+void reserveUsers(int count) {
+    users = (User*)resizeArray(users, users_size * sizeof(User), (users_size + count) * sizeof(User));
+    studentCourses = (IdList*)countedRealloc(studentCourses, (users_size + count) * sizeof(IdList));
+}
+
+// Append a user to the room made by reserveUsers() and index it
+User* appendUser(const User* user) {
+    UndoEntry* undo = undoEntry(UNDO_USER_ADDED);
+    if (undo) undo->position = users_size;
+    users[users_size] = *user;
+    memset(&studentCourses[users_size], 0, sizeof(IdList));
+    indexInsert(&userIdIndex, users_size);
+    indexInsert(&usernameIndex, users_size);
+    return &users[users_size++];
+}
+
+// Change a user's username, keeping the username index in sync
+void renameUser(User* user, const char* username) {
+    int position = user - users;
+    undoUser(user);
+    indexRemove(&usernameIndex, position);
+    user->username = internString(username);
+    indexInsert(&usernameIndex, position);
+    if (user->type == FACULTY) catalogChanged();
+}
+
+// Add a course and index it, in a free slot if there is one
+Course* addCourse(const Course* course) {
+    UndoEntry* undo = undoEntry(UNDO_COURSE_ADDED);
+    if (undo) {
+        undo->lastCourseId = last_course_id;
+        undo->reused = freeCourseSlots.size > 0;
+        undo->position = undo->reused ? freeCourseSlots.ids[freeCourseSlots.size - 1] : courses_size;
+    }
+    if (course->id > last_course_id) last_course_id = course->id;
+    catalogChanged();
+    if (freeCourseSlots.size > 0) {
+        int position = freeCourseSlots.ids[--freeCourseSlots.size];
+        courses[position] = *course;
+        indexInsert(&courseIdIndex, position);
+        indexInsert(&courseCodeIndex, position);
+        return &courses[position];
     }
-    fclose(userFile);
+    courses = (Course*)resizeArray(courses, courses_size * sizeof(Course), (courses_size + 1) * sizeof(Course));
+    courses[courses_size] = *course;
+    courseStudents = (IdList*)countedRealloc(courseStudents, (courses_size + 1) * sizeof(IdList));
+    memset(&courseStudents[courses_size], 0, sizeof(IdList));
+    courseWaitlists = (IdQueue*)countedRealloc(courseWaitlists, (courses_size + 1) * sizeof(IdQueue));
+    memset(&courseWaitlists[courses_size], 0, sizeof(IdQueue));
+    indexInsert(&courseIdIndex, courses_size);
+    indexInsert(&courseCodeIndex, courses_size);
+    return &courses[courses_size++];
+}
 
-    // Save courses
-    FILE* courseFile = fopen(COURSE_FILE, "w");
+// Remove the course at the given position, with its waitlist, leaving a
+// tombstone in its slot. The course's enrollments must already have been
+// removed with removeCourseEnrollments(). An atomic batch keeps the course
+// and its waitlist in its undo log.
+void removeCourseAt(int position) {
+    UndoEntry* undo = undoEntry(UNDO_COURSE_REMOVED);
+    indexRemove(&courseIdIndex, position);
+    indexRemove(&courseCodeIndex, position);
+    free(courseStudents[position].ids);
+    if (undo) {
+        undo->position = position;
+        undo->course = courses[position];
+        undo->waitlist = courseWaitlists[position];
+    } else {
+        free(courseWaitlists[position].ids);
+    }
+    memset(&courseStudents[position], 0, sizeof(IdList));
+    memset(&courseWaitlists[position], 0, sizeof(IdQueue));
+    memset(&courses[position], 0, sizeof(Course));
+    idListAdd(&freeCourseSlots, position);
+    catalogChanged();
+    noteTombstone(freeCourseSlots.size, courses_size);
+}
+
+// Wake the compactor once a table's tombstones pass the threshold
+void noteTombstone(int tombstones, int slots) {
+    if (tombstones < COMPACTION_MIN_TOMBSTONES || tombstones * COMPACTION_RATIO < slots) return;
+    pthread_mutex_lock(&compaction_lock);
+    compaction_requested = 1;
+    pthread_cond_signal(&compaction_wanted);
+    pthread_mutex_unlock(&compaction_lock);
+}
+
+// Move the live courses and enrollments down over the tombstones, shrink the
+// arrays and rebuild the indexes. Needs the exclusive table lock; the
+// adjacency lists hold ids, not positions, and move along with their course.
+void compactTables() {
+    catalogChanged();
+    int live = 0;
     for (int i = 0; i < courses_size; i++) {
-        fprintf(courseFile, "%d %s %d %d %d %s\n", courses[i].id, courses[i].code, 
-                courses[i].facultyId, courses[i].totalSeats, courses[i].enrolledStudents, 
-                courses[i].name);
+        if (!courses[i].id) continue;
+        if (i != live) {
+            courses[live] = courses[i];
+            courseStudents[live] = courseStudents[i];
+            courseWaitlists[live] = courseWaitlists[i];
+        }
+        live++;
+    }
+    if (live != courses_size) {
+        courses = (Course*)resizeArray(courses, courses_size * sizeof(Course), live * sizeof(Course));
+        courseStudents = (IdList*)countedRealloc(courseStudents, live * sizeof(IdList));
+        courseWaitlists = (IdQueue*)countedRealloc(courseWaitlists, live * sizeof(IdQueue));
+        courses_size = live;
+        rebuildCourseIndexes();
     }
-    fclose(courseFile);
 
-    // Save enrollments
-    FILE* enrollmentFile = fopen(ENROLLMENT_FILE, "w");
+    live = 0;
     for (int i = 0; i < enrollments_size; i++) {
-        fprintf(enrollmentFile, "%d %d\n", enrollments[i].studentId, enrollments[i].courseId);
+        if (!enrollments[i].studentId) continue;
+        if (i != live) enrollments[live] = enrollments[i];
+        live++;
+    }
+    if (live != enrollments_size) {
+        enrollments = (Enrollment*)resizeArray(enrollments, enrollments_size * sizeof(Enrollment),
+                                               live * sizeof(Enrollment));
+        enrollments_size = live;
+        freeEnrollmentSlots.size = 0;
+        indexReset(&enrollmentIndex, enrollments_size);
+        for (int i = 0; i < enrollments_size; i++) indexInsert(&enrollmentIndex, i);
     }
-    fclose(enrollmentFile);
+    compactions++;
+}
 
-    sem_post(&mutex);
+// Compactor thread: compact the tables whenever a removal asks for it
+void* compactor(void* arg) {
+    while (1) {
+        pthread_mutex_lock(&compaction_lock);
+        while (!compaction_requested) {
+            pthread_cond_wait(&compaction_wanted, &compaction_lock);
+        }
+        compaction_requested = 0;
+        pthread_mutex_unlock(&compaction_lock);
+
+        acquireWriteLock();
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int slots = courses_size + enrollments_size;
+        compactTables();
+        printf("Compacted tables: %d slots freed in %.1f ms\n",
+               slots - courses_size - enrollments_size, elapsedMs(&start));
+        releaseLock();
+    }
+    return NULL;
 }
 
-// Function to handle client connections
-void* handleClient(void* client_socket) {
-    int sock = *(int*)client_socket;
-    free(client_socket);
+// Claim a seat in a course without locking: compare-and-swap the counter
+// from n to n + 1 as long as n is below the capacity. Returns 0 if the course
+// is full.
+int reserveSeat(Course* course) {
+    int seats = __atomic_load_n(&course->enrolledStudents, __ATOMIC_ACQUIRE);
+    do {
+        if (seats >= course->totalSeats) return 0;
+    } while (!__atomic_compare_exchange_n(&course->enrolledStudents, &seats, seats + 1, 1,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    undoSeats(course, seats);
+    catalogSeatsChanged(course);
+    return 1;
+}
 
-    char buffer[BUFFER_SIZE] = {0};
+// Give back a seat claimed with reserveSeat()
+void releaseSeat(Course* course) {
+    int seats = __atomic_fetch_sub(&course->enrolledStudents, 1, __ATOMIC_ACQ_REL);
+    undoSeats(course, seats);
+    catalogSeatsChanged(course);
+}
 
-    while (1) {
-        // Clear the buffer
-        memset(buffer, 0, BUFFER_SIZE);
+// Append an id to a list
+void idListAdd(IdList* list, int id) {
+    if (list->size == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 4;
+        list->ids = (int*)countedRealloc(list->ids, list->capacity * sizeof(int));
+    }
+    list->ids[list->size++] = id;
+}
 
-        // Read client message
-        ssize_t bytesRead = read(sock, buffer, BUFFER_SIZE - 1);
-        if (bytesRead <= 0) {
-            close(sock);
-            printf("Client disconnected\n");
-            return NULL;
+// Remove an id from a list, keeping the remaining ids in order. Returns
+// where it was, or -1 if it was not in the list.
+int idListRemove(IdList* list, int id) {
+    for (int i = 0; i < list->size; i++) {
+        if (list->ids[i] == id) {
+            memmove(&list->ids[i], &list->ids[i+1], (list->size - i - 1) * sizeof(int));
+            list->size--;
+            return i;
         }
+    }
+    return -1;
+}
 
-        // Process the request
-        char* response = processRequest(buffer, sock);
-
-        // Send response back to client
-        send(sock, response, strlen(response), 0);
-        free(response);
+// Put an id back at a position of a list
+void idListInsert(IdList* list, int at, int id) {
+    idListAdd(list, id);
+    memmove(&list->ids[at+1], &list->ids[at], (list->size - at - 1) * sizeof(int));
+    list->ids[at] = id;
+}
 
-        // If client sent "EXIT", close the connection
-        if (strcmp(buffer, "EXIT") == 0) {
-            printf("Client requested to exit\n");
-            close(sock);
-            return NULL;
-        }
+// Append an id at the tail of a queue
+void idQueuePush(IdQueue* queue, int id) {
+    if (queue->size == queue->capacity) {
+        // Grow and unwrap, so the ids start at 0 again
+        int capacity = queue->capacity ? queue->capacity * 2 : 4;
+        int* ids = (int*)countedRealloc(NULL, capacity * sizeof(int));
+        for (int i = 0; i < queue->size; i++) ids[i] = idQueueAt(queue, i);
+        free(queue->ids);
+        queue->ids = ids;
+        queue->head = 0;
+        queue->capacity = capacity;
     }
+    queue->ids[(queue->head + queue->size) % queue->capacity] = id;
+    queue->size++;
+}
 
-    return NULL;
+// Take the id at the head of a queue; the queue must not be empty
+int idQueuePop(IdQueue* queue) {
+    int id = queue->ids[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->size--;
+    return id;
 }
 
-// Process client requests
-char* processRequest(const char* request, int clientSocket) {
-    char* response = (char*)malloc(BUFFER_SIZE);
-    response[0] = '\0';
+// The id at a position of a queue, counting from the head
+int idQueueAt(const IdQueue* queue, int i) {
+    return queue->ids[(queue->head + i) % queue->capacity];
+}
 
-    char* token = strtok((char*)request, " ");
-    if (!token) {
-        strcpy(response, "Invalid request");
-        return response;
+// Remove an id from a queue, keeping the others in order; returns its 1-based
+// position, or 0 if it was not queued
+int idQueueRemove(IdQueue* queue, int id) {
+    int i = 0;
+    while (i < queue->size && idQueueAt(queue, i) != id) i++;
+    if (i == queue->size) return 0;
+    int position = i + 1;
+    for (; i < queue->size - 1; i++) {
+        queue->ids[(queue->head + i) % queue->capacity] = idQueueAt(queue, i + 1);
     }
+    queue->size--;
+    return position;
+}
 
-    char command[50];
-    strcpy(command, token);
-
-    // Handle login request
-    if (strcmp(command, "LOGIN") == 0) {
-        char* username = strtok(NULL, " ");
-        char* password = strtok(NULL, " ");
-        if (username && password) {
-            strcpy(response, loginUser(username, password));
-        } else {
-            strcpy(response, "Invalid login format");
-        }
+// Put an id back at a position of a queue, counting from the head
+void idQueueInsert(IdQueue* queue, int at, int id) {
+    idQueuePush(queue, id);
+    for (int i = queue->size - 1; i > at; i--) {
+        queue->ids[(queue->head + i) % queue->capacity] = idQueueAt(queue, i - 1);
     }
-    // Handle role-specific requests
-    else if (strcmp(command, "ADMIN") == 0 || strcmp(command, "STUDENT") == 0 || 
-             strcmp(command, "FACULTY") == 0) {
-        char* userIdStr = strtok(NULL, " ");
-        if (!userIdStr) {
-            strcpy(response, "Invalid request format");
-            return response;
-        }
-        int userId = atoi(userIdStr);
-        char* subRequest = strtok(NULL, "");
-        if (!subRequest) subRequest = "";
+    queue->ids[(queue->head + at) % queue->capacity] = id;
+}
 
-        if (strcmp(command, "ADMIN") == 0) {
-            strcpy(response, handleAdminRequest(subRequest, userId));
-        } else if (strcmp(command, "STUDENT") == 0) {
-            strcpy(response, handleStudentRequest(subRequest, userId));
-        } else {
-            strcpy(response, handleFacultyRequest(subRequest, userId));
+// Adjacency list of a student's courses, or NULL if the student is unknown
+IdList* coursesOfStudent(int studentId) {
+    User* user = findUserById(studentId);
+    return user ? &studentCourses[user - users] : NULL;
+}
+
+// Adjacency list of a course's students, or NULL if the course is unknown
+IdList* studentsOfCourse(int courseId) {
+    Course* course = findCourseById(courseId);
+    return course ? &courseStudents[course - courses] : NULL;
+}
+
+// Rebuild the enrollment index, adjacency lists, free slot list and seat
+// counts from the enrollments array
+void rebuildEnrollmentIndexes() {
+    studentCourses = (IdList*)countedRealloc(studentCourses, users_size * sizeof(IdList));
+    memset(studentCourses, 0, users_size * sizeof(IdList));
+    courseStudents = (IdList*)countedRealloc(courseStudents, courses_size * sizeof(IdList));
+    memset(courseStudents, 0, courses_size * sizeof(IdList));
+
+    indexReset(&enrollmentIndex, enrollments_size);
+    freeEnrollmentSlots.size = 0;
+    for (int i = 0; i < enrollments_size; i++) {
+        if (!enrollments[i].studentId) {
+            idListAdd(&freeEnrollmentSlots, i);
+            continue;
         }
-    } else {
-        strcpy(response, "Invalid request format");
+        indexInsert(&enrollmentIndex, i);
+        IdList* enrolled = coursesOfStudent(enrollments[i].studentId);
+        IdList* roster = studentsOfCourse(enrollments[i].courseId);
+        if (enrolled) idListAdd(enrolled, enrollments[i].courseId);
+        if (roster) idListAdd(roster, enrollments[i].studentId);
     }
 
-    return response;
+    // Seat counts follow the rosters. The data files are written while ENROLL
+    // claims seats before taking its course lock, so a saved count may be off
+    // by the enrollments that were in flight.
+    for (int i = 0; i < courses_size; i++) {
+        if (courses[i].id) courses[i].enrolledStudents = courseStudents[i].size;
+    }
 }
 
-// User login
-char* loginUser(const char* username, const char* password) {
-    char* response = (char*)malloc(BUFFER_SIZE);
-    for (int i = 0; i < users_size; i++) {
-        if (strcmp(users[i].username, username) == 0 && 
-            strcmp(users[i].password, password) == 0) {
-            if (!users[i].active) {
-                strcpy(response, "LOGIN_FAILED Account deactivated");
-                return response;
-            }
-            const char* userType = users[i].type == ADMIN ? "ADMIN" : 
-                                 users[i].type == STUDENT ? "STUDENT" : "FACULTY";
-            sprintf(response, "LOGIN_SUCCESS %s %d", userType, users[i].id);
-            return response;
+// Position of an enrollment in the enrollments array, or -1
+int findEnrollment(int studentId, int courseId) {
+    if (!enrollmentIndex.slots) return -1;
+    unsigned int mask = enrollmentIndex.capacity - 1;
+    for (unsigned int slot = hashEnrollment(studentId, courseId) & mask; enrollmentIndex.slots[slot] != INDEX_EMPTY; slot = (slot + 1) & mask) {
+        int position = enrollmentIndex.slots[slot];
+        if (position >= 0 && enrollments[position].studentId == studentId &&
+            enrollments[position].courseId == courseId) {
+            return position;
         }
     }
-    strcpy(response, "LOGIN_FAILED Invalid credentials");
-    return response;
+    return -1;
 }
 
-// Handle admin requests
-char* handleAdminRequest(const char* request, int userId) {
-    char* response = (char*)malloc(BUFFER_SIZE);
-    User* admin = findUserById(userId);
-    if (!admin || admin->type != ADMIN) {
-        strcpy(response, "Access denied");
-        return response;
+// Record an enrollment in the array, in a free slot if there is one, and in
+// all enrollment indexes. The shared array and index change under
+// enrollment_lock; requests hold the course's stripe for its roster.
+void addEnrollment(int studentId, int courseId) {
+    pthread_mutex_lock(&enrollment_lock);
+    UndoEntry* undo = undoEntry(UNDO_ENROLLMENT_ADDED);
+    if (undo) {
+        undo->studentId = studentId;
+        undo->courseId = courseId;
+        undo->reused = freeEnrollmentSlots.size > 0;
     }
-
-    char* token = strtok((char*)request, " ");
-    if (!token) {
-        strcpy(response, "Invalid admin request");
-        return response;
+    int position;
+    if (freeEnrollmentSlots.size > 0) {
+        position = freeEnrollmentSlots.ids[--freeEnrollmentSlots.size];
+    } else {
+        enrollments = (Enrollment*)resizeArray(enrollments, enrollments_size * sizeof(Enrollment),
+                                               (enrollments_size + 1) * sizeof(Enrollment));
+        position = enrollments_size++;
     }
+    if (undo) undo->position = position;
+    enrollments[position].studentId = studentId;
+    enrollments[position].courseId = courseId;
+    indexInsert(&enrollmentIndex, position);
 
-    char command[50];
-    strcpy(command, token);
+    IdList* enrolled = coursesOfStudent(studentId);
+    if (enrolled) idListAdd(enrolled, courseId);
+    pthread_mutex_unlock(&enrollment_lock);
 
-    if (strcmp(command, "ADD_STUDENT") == 0) {
-        char* username = strtok(NULL, " ");
-        char* password = strtok(NULL, " ");
-        if (!username || !password) {
-            strcpy(response, "Invalid format");
-            return response;
-        }
-        if (findUserByUsername(username)) {
-            sprintf(response, "Student with username %s already exists", username);
-            return response;
-        }
-        User student;
-        student.id = users_size ? users[users_size-1].id + 1 : 1;
-        strncpy(student.username, username, MAX_STR-1);
-        student.username[MAX_STR-1] = '\0';
-        strncpy(student.password, password, MAX_STR-1);
-        student.password[MAX_STR-1] = '\0';
-        student.type = STUDENT;
-        student.active = 1;
-        users = (User*)realloc(users, (users_size + 1) * sizeof(User));
-        users[users_size++] = student;
-        saveData();
-        sprintf(response, "Student added successfully with ID %d", student.id);
-    }
-    else if (strcmp(command, "ADD_FACULTY") == 0) {
-        char* username = strtok(NULL, " ");
-        char* password = strtok(NULL, " ");
-        if (!username || !password) {
-            strcpy(response, "Invalid format");
-            return response;
-        }
-        if (findUserByUsername(username)) {
-            sprintf(response, "Faculty with username %s already exists", username);
-            return response;
-        }
-        User faculty;
-        faculty.id = users_size ? users[users_size-1].id + 1 : 1;
-        strncpy(faculty.username, username, MAX_STR-1);
-        faculty.username[MAX_STR-1] = '\0';
-        strncpy(faculty.password, password, MAX_STR-1);
-        faculty.password[MAX_STR-1] = '\0';
-        faculty.type = FACULTY;
-        faculty.active = 1;
-        users = (User*)realloc(users, (users_size + 1) * sizeof(User));
-        users[users_size++] = faculty;
-        saveData();
-        sprintf(response, "Faculty added successfully with ID %d", faculty.id);
+    IdList* roster = studentsOfCourse(courseId);
+    if (roster) idListAdd(roster, studentId);
+}
+
+// Remove an enrollment, leaving a tombstone; returns 0 if the student was not
+// enrolled. This is O(1) apart from the (short) adjacency lists. Locked like
+// addEnrollment().
+int removeEnrollment(int studentId, int courseId) {
+    pthread_mutex_lock(&enrollment_lock);
+    int position = findEnrollment(studentId, courseId);
+    if (position < 0) {
+        pthread_mutex_unlock(&enrollment_lock);
+        return 0;
     }
-    else if (strcmp(command, "TOGGLE_STUDENT") == 0) {
-        char* studentIdStr = strtok(NULL, " ");
-        if (!studentIdStr) {
-            strcpy(response, "Invalid format");
-            return response;
-        }
-        int studentId = atoi(studentIdStr);
-        User* student = findUserById(studentId);
-        if (!student || student->type != STUDENT) {
-            strcpy(response, "Student not found");
-            return response;
-        }
-        student->active = !student->active;
-        saveData();
-        sprintf(response, "Student %s %s successfully", student->username, 
-                student->active ? "activated" : "deactivated");
-    }
-    else if (strcmp(command, "UPDATE_USER") == 0) {
-        char* userIdStr = strtok(NULL, " ");
-        char* field = strtok(NULL, " ");
-        char* value = strtok(NULL, " ");
-        if (!userIdStr || !field || !value) {
-            strcpy(response, "Invalid format");
-            return response;
-        }
-        int userId = atoi(userIdStr);
-        User* user = findUserById(userId);
-        if (!user) {
-            strcpy(response, "User not found");
-            return response;
-        }
-        if (strcmp(field, "password") == 0) {
-            strncpy(user->password, value, MAX_STR-1);
-            user->password[MAX_STR-1] = '\0';
-            saveData();
-            strcpy(response, "Password updated successfully");
-        }
-        else if (strcmp(field, "username") == 0) {
-            if (findUserByUsername(value)) {
-                sprintf(response, "Username %s already exists", value);
-            } else {
-                strncpy(user->username, value, MAX_STR-1);
-                user->username[MAX_STR-1] = '\0';
-                saveData();
-                strcpy(response, "Username updated successfully");
-            }
-        }
-        else {
-            strcpy(response, "Invalid field to update");
-        }
-    }
-    else if (strcmp(command, "VIEW_USERS") == 0) {
-        char* result = (char*)malloc(BUFFER_SIZE);
-        strcpy(result, "Users list:\n");
-        for (int i = 0; i < users_size; i++) {
-            const char* userType = users[i].type == ADMIN ? "ADMIN" : 
-                                 users[i].type == STUDENT ? "STUDENT" : "FACULTY";
-            char line[256];
-            sprintf(line, "ID: %d, Username: %s, Type: %s, Status: %s\n", 
-                    users[i].id, users[i].username, userType, 
-                    users[i].active ? "Active" : "Inactive");
-            strncat(result, line, BUFFER_SIZE - strlen(result) - 1);
-        }
-        strcpy(response, result);
-        free(result);
-    }
-    else if (strcmp(command, "VIEW_COURSES") == 0) {
-        acquireReadLock(COURSE_FILE);
-        char* result = (char*)malloc(BUFFER_SIZE);
-        strcpy(result, "Courses list:\n");
-        for (int i = 0; i < courses_size; i++) {
-            User* faculty = findUserById(courses[i].facultyId);
-            char line[256];
-            sprintf(line, "ID: %d, Code: %s, Name: %s, Faculty: %s, Seats: %d/%d\n", 
-                    courses[i].id, courses[i].code, courses[i].name, 
-                    faculty ? faculty->username : "Unknown", 
-                    courses[i].enrolledStudents, courses[i].totalSeats);
-            strncat(result, line, BUFFER_SIZE - strlen(result) - 1);
-        }
-        releaseLock(COURSE_FILE);
-        strcpy(response, result);
-        free(result);
+
+    indexRemove(&enrollmentIndex, position);
+    enrollments[position].studentId = 0;
+    enrollments[position].courseId = 0;
+    idListAdd(&freeEnrollmentSlots, position);
+    noteTombstone(freeEnrollmentSlots.size, enrollments_size);
+    IdList* enrolled = coursesOfStudent(studentId);
+    int at = enrolled ? idListRemove(enrolled, courseId) : -1;
+    pthread_mutex_unlock(&enrollment_lock);
+
+    IdList* roster = studentsOfCourse(courseId);
+    int rosterAt = roster ? idListRemove(roster, studentId) : -1;
+    UndoEntry* undo = undoEntry(UNDO_ENROLLMENT_REMOVED);
+    if (undo) {
+        undo->position = position;
+        undo->studentId = studentId;
+        undo->courseId = courseId;
+        undo->at = at;
+        undo->rosterAt = rosterAt;
     }
-    else {
-        strcpy(response, "Invalid admin command");
+    return 1;
+}
+
+// Remove every enrollment in a course, in time proportional to its roster
+void removeCourseEnrollments(int courseId) {
+    IdList* roster = studentsOfCourse(courseId);
+    if (!roster) return;
+    while (roster->size > 0) {
+        removeEnrollment(roster->ids[roster->size - 1], courseId);
     }
+}
 
-    return response;
+// Record a change to a course's enrollments or waitlist while its stripe of
+// course_locks is held. The journal record is appended under the lock, so
+// records for the same course reach the journal in the order the changes
+// were made. Returns the sequence number for finishLockedRecord().
+static unsigned long lockedRecord(char op, int studentId, int courseId) {
+    char record[64];
+    snprintf(record, sizeof(record), "%c %d %d", op, studentId, courseId);
+    if (active_batch) {
+        batchRecord(active_batch, record);
+    } else if (journal_mode) {
+        return journalAppend(record);
+    }
+    return 0;
 }
 
-// Handle student requests
-char* handleStudentRequest(const char* request, int userId) {
-    char* response = (char*)malloc(BUFFER_SIZE);
-    User* student = findUserById(userId);
-    if (!student || student->type != STUDENT) {
-        strcpy(response, "Access denied");
-        return response;
-    }
-
-    char* token = strtok((char*)request, " ");
-    if (!token) {
-        strcpy(response, "Invalid student request");
-        return response;
-    }
-
-    char command[50];
-    strcpy(command, token);
-
-    if (strcmp(command, "ENROLL") == 0) {
-        char* courseCode = strtok(NULL, " ");
-        if (!courseCode) {
-            strcpy(response, "Invalid format");
-            return response;
-        }
-        acquireWriteLock(COURSE_FILE);
-        acquireWriteLock(ENROLLMENT_FILE);
-        Course* course = findCourseByCode(courseCode);
-        if (!course) {
-            releaseLock(COURSE_FILE);
-            releaseLock(ENROLLMENT_FILE);
-            strcpy(response, "Course not found");
-            return response;
-        }
-        if (isEnrolled(student->id, course->id)) {
-            releaseLock(COURSE_FILE);
-            releaseLock(ENROLLMENT_FILE);
-            strcpy(response, "Already enrolled in this course");
-            return response;
-        }
-        if (course->enrolledStudents >= course->totalSeats) {
-            releaseLock(COURSE_FILE);
-            releaseLock(ENROLLMENT_FILE);
-            strcpy(response, "Course is full");
-            return response;
-        }
-        Enrollment enrollment;
-        enrollment.studentId = student->id;
-        enrollment.courseId = course->id;
-        enrollments = (Enrollment*)realloc(enrollments, (enrollments_size + 1) * sizeof(Enrollment));
-        enrollments[enrollments_size++] = enrollment;
-        course->enrolledStudents++;
-        saveData();
-        releaseLock(COURSE_FILE);
-        releaseLock(ENROLLMENT_FILE);
-        sprintf(response, "Successfully enrolled in %s - %s", course->code, course->name);
-    }
-    else if (strcmp(command, "UNENROLL") == 0) {
-        char* courseCode = strtok(NULL, " ");
-        if (!courseCode) {
-            strcpy(response, "Invalid format");
-            return response;
-        }
-        acquireWriteLock(COURSE_FILE);
-        acquireWriteLock(ENROLLMENT_FILE);
-        Course* course = findCourseByCode(courseCode);
-        if (!course) {
-            releaseLock(COURSE_FILE);
-            releaseLock(ENROLLMENT_FILE);
-            strcpy(response, "Course not found");
-            return response;
-        }
-        int found = 0;
-        for (int i = 0; i < enrollments_size; i++) {
-            if (enrollments[i].studentId == student->id && enrollments[i].courseId == course->id) {
-                for (int j = i; j < enrollments_size-1; j++) {
-                    enrollments[j] = enrollments[j+1];
-                }
-                enrollments_size--;
-                enrollments = (Enrollment*)realloc(enrollments, enrollments_size * sizeof(Enrollment));
-                found = 1;
-                break;
-            }
-        }
-        if (!found) {
-            releaseLock(COURSE_FILE);
-            releaseLock(ENROLLMENT_FILE);
-            strcpy(response, "Not enrolled in this course");
-            return response;
-        }
-        course->enrolledStudents--;
-        saveData();
-        releaseLock(COURSE_FILE);
-        releaseLock(ENROLLMENT_FILE);
-        sprintf(response, "Successfully unenrolled from %s - %s", course->code, course->name);
-    }
-    else if (strcmp(command, "VIEW_ENROLLED") == 0) {
-        acquireReadLock(COURSE_FILE);
-        acquireReadLock(ENROLLMENT_FILE);
-        char* result = (char*)malloc(BUFFER_SIZE);
-        strcpy(result, "Enrolled courses:\n");
-        int hasEnrollments = 0;
-        for (int i = 0; i < enrollments_size; i++) {
-            if (enrollments[i].studentId == student->id) {
-                Course* course = findCourseById(enrollments[i].courseId);
-                if (course) {
-                    char line[256];
-                    sprintf(line, "Code: %s, Name: %s\n", course->code, course->name);
-                    strncat(result, line, BUFFER_SIZE - strlen(result) - 1);
-                    hasEnrollments = 1;
-                }
-            }
-        }
-        releaseLock(COURSE_FILE);
-        releaseLock(ENROLLMENT_FILE);
-        if (!hasEnrollments) {
-            strcpy(response, "You are not enrolled in any courses");
-        } else {
-            strcpy(response, result);
-        }
-        free(result);
-    }
-    else if (strcmp(command, "VIEW_COURSES") == 0) {
-        acquireReadLock(COURSE_FILE);
-        char* result = (char*)malloc(BUFFER_SIZE);
-        strcpy(result, "Available courses:\n");
-        for (int i = 0; i < courses_size; i++) {
-            User* faculty = findUserById(courses[i].facultyId);
-            char line[256];
-            sprintf(line, "Code: %s, Name: %s, Faculty: %s, Available seats: %d/%d\n", 
-                    courses[i].code, courses[i].name, 
-                    faculty ? faculty->username : "Unknown", 
-                    courses[i].totalSeats - courses[i].enrolledStudents, 
-                    courses[i].totalSeats);
-            strncat(result, line, BUFFER_SIZE - strlen(result) - 1);
-        }
-        releaseLock(COURSE_FILE);
-        strcpy(response, result);
-        free(result);
-    }
-    else if (strcmp(command, "CHANGE_PASSWORD") == 0) {
-        char* oldPassword = strtok(NULL, " ");
-        char* newPassword = strtok(NULL, " ");
-        if (!oldPassword || !newPassword) {
-            strcpy(response, "Invalid format");
-            return response;
-        }
-        if (strcmp(student->password, oldPassword) != 0) {
-            strcpy(response, "Incorrect current password");
-            return response;
-        }
-        strncpy(student->password, newPassword, MAX_STR-1);
-        student->password[MAX_STR-1] = '\0';
-        saveData();
-        strcpy(response, "Password changed successfully");
+// Release the course's lock and make the change from lockedRecord() durable,
+// unless the running batch does that when it commits
+static void finishLockedRecord(int courseId, unsigned long lsn) {
+    unlockCourse(courseId);
+    if (active_batch) {
+        return;
+    } else if (journal_mode) {
+        journalSync(lsn);
+    } else if (bgsave_mode) {
+        markDirty();
+    } else {
+        markUnsaved();
     }
-    else {
-        strcpy(response, "Invalid student command");
+}
+
+// Enroll or unenroll a student and persist the change
+static int changeEnrollment(char op, int studentId, int courseId) {
+    lockCourse(courseId);
+    if (op == 'E' ? isEnrolled(studentId, courseId) : !removeEnrollment(studentId, courseId)) {
+        unlockCourse(courseId);
+        return 0;
     }
+    if (op == 'E') addEnrollment(studentId, courseId);
+    finishLockedRecord(courseId, lockedRecord(op, studentId, courseId));
+    return 1;
+}
+
+// Returns 0 if the student is already enrolled. The caller has reserved a seat.
+int enrollStudent(int studentId, int courseId) {
+    return changeEnrollment('E', studentId, courseId);
+}
 
-    return response;
+// Returns 0 if the student was not enrolled. The caller releases the seat.
+int unenrollStudent(int studentId, int courseId) {
+    return changeEnrollment('X', studentId, courseId);
 }
 
-// Handle faculty requests
-char* handleFacultyRequest(const char* request, int userId) {
-    char* response = (char*)malloc(BUFFER_SIZE);
-    User* faculty = findUserById(userId);
-    if (!faculty || faculty->type != FACULTY) {
-        strcpy(response, "Access denied");
-        return response;
+// Waitlist of a course, or NULL if the course is unknown
+IdQueue* waitlistOf(int courseId) {
+    Course* course = findCourseById(courseId);
+    return course ? &courseWaitlists[course - courses] : NULL;
+}
+
+// 1-based position of a student on a course's waitlist, or 0 if not on it
+int waitlistPosition(int studentId, int courseId) {
+    IdQueue* waitlist = waitlistOf(courseId);
+    if (!waitlist) return 0;
+    for (int i = 0; i < waitlist->size; i++) {
+        if (idQueueAt(waitlist, i) == studentId) return i + 1;
     }
+    return 0;
+}
 
-    char* token = strtok((char*)request, " ");
-    if (!token) {
-        strcpy(response, "Invalid faculty request");
-        return response;
+// Queue a student for a course and persist it. Returns the student's position,
+// or 0 if they are already enrolled; a student already queued keeps their place.
+int joinWaitlist(int studentId, int courseId) {
+    lockCourse(courseId);
+    int position = waitlistPosition(studentId, courseId);
+    if (position || isEnrolled(studentId, courseId)) {
+        unlockCourse(courseId);
+        return position;
     }
+    IdQueue* waitlist = waitlistOf(courseId);
+    idQueuePush(waitlist, studentId);
+    position = waitlist->size;
+    UndoEntry* undo = undoEntry(UNDO_WAITLIST_PUSHED);
+    if (undo) undo->position = waitlist - courseWaitlists;
+    finishLockedRecord(courseId, lockedRecord('W', studentId, courseId));
+    return position;
+}
 
-    char command[50];
-    strcpy(command, token);
+// Take a student off a course's waitlist; returns 0 if they were not on it
+int leaveWaitlist(int studentId, int courseId) {
+    lockCourse(courseId);
+    IdQueue* waitlist = waitlistOf(courseId);
+    int position = waitlist ? idQueueRemove(waitlist, studentId) : 0;
+    if (!position) {
+        unlockCourse(courseId);
+        return 0;
+    }
+    UndoEntry* undo = undoEntry(UNDO_WAITLIST_REMOVED);
+    if (undo) {
+        undo->position = waitlist - courseWaitlists;
+        undo->studentId = studentId;
+        undo->at = position - 1;
+    }
+    finishLockedRecord(courseId, lockedRecord('L', studentId, courseId));
+    return 1;
+}
 
-    if (strcmp(command, "ADD_COURSE") == 0) {
-        char* courseCode = strtok(NULL, " ");
-        char* seatsStr = strtok(NULL, " ");
-        char* courseName = strtok(NULL, "");
-        if (!courseCode || !seatsStr || !courseName) {
-            strcpy(response, "Invalid format");
-            return response;
-        }
-        int seats = atoi(seatsStr);
-        acquireWriteLock(COURSE_FILE);
-        for (int i = 0; i < courses_size; i++) {
-            if (strcmp(courses[i].code, courseCode) == 0) {
-                releaseLock(COURSE_FILE);
-                sprintf(response, "Course with code %s already exists", courseCode);
-                return response;
-            }
-        }
-        Course course;
-        course.id = courses_size ? courses[courses_size-1].id + 1 : 1;
-        strncpy(course.code, courseCode, MAX_STR-1);
-        course.code[MAX_STR-1] = '\0';
-        strncpy(course.name, courseName, MAX_STR-1);
-        course.name[MAX_STR-1] = '\0';
-        course.facultyId = faculty->id;
-        course.totalSeats = seats;
-        course.enrolledStudents = 0;
-        courses = (Course*)realloc(courses, (courses_size + 1) * sizeof(Course));
-        courses[courses_size++] = course;
-        saveData();
-        releaseLock(COURSE_FILE);
-        sprintf(response, "Course added successfully: %s - %s", courseCode, courseName);
-    }
-    else if (strcmp(command, "REMOVE_COURSE") == 0) {
-        char* courseCode = strtok(NULL, " ");
-        if (!courseCode) {
-            strcpy(response, "Invalid format");
-            return response;
-        }
-        acquireWriteLock(COURSE_FILE);
-        acquireWriteLock(ENROLLMENT_FILE);
-        int courseId = -1;
-        for (int i = 0; i < courses_size; i++) {
-            if (strcmp(courses[i].code, courseCode) == 0 && courses[i].facultyId == faculty->id) {
-                courseId = courses[i].id;
-                for (int j = i; j < courses_size-1; j++) {
-                    courses[j] = courses[j+1];
-                }
-                courses_size--;
-                courses = (Course*)realloc(courses, courses_size * sizeof(Course));
-                break;
-            }
+// Give the free seats of a course to the students at the head of its
+// waitlist, each taken off the queue and enrolled in one step. Returns the
+// number of students promoted.
+int promoteWaitlist(Course* course) {
+    int promoted = 0;
+    for (;;) {
+        lockCourse(course->id);
+        IdQueue* waitlist = &courseWaitlists[course - courses];
+        if (waitlist->size == 0 || !reserveSeat(course)) {
+            unlockCourse(course->id);
+            return promoted;
         }
-        if (courseId == -1) {
-            releaseLock(COURSE_FILE);
-            releaseLock(ENROLLMENT_FILE);
-            strcpy(response, "Course not found or you don't have permission to remove it");
-            return response;
-        }
-        int new_size = 0;
-        for (int i = 0; i < enrollments_size; i++) {
-            if (enrollments[i].courseId != courseId) {
-                enrollments[new_size] = enrollments[i];
-                new_size++;
-            }
-        }
-        enrollments_size = new_size;
-        enrollments = (Enrollment*)realloc(enrollments, enrollments_size * sizeof(Enrollment));
-        saveData();
-        releaseLock(COURSE_FILE);
-        releaseLock(ENROLLMENT_FILE);
-        sprintf(response, "Course %s removed successfully", courseCode);
-    }
-    else if (strcmp(command, "VIEW_ENROLLMENTS") == 0) {
-        acquireReadLock(COURSE_FILE);
-        acquireReadLock(ENROLLMENT_FILE);
-        char* result = (char*)malloc(BUFFER_SIZE);
-        strcpy(result, "Course enrollments:\n");
-        int hasCourses = 0;
-        for (int i = 0; i < courses_size; i++) {
-            if (courses[i].facultyId == faculty->id) {
-                char line[256];
-                sprintf(line, "\nCourse: %s - %s\nEnrolled students: %d/%d\n", 
-                        courses[i].code, courses[i].name, 
-                        courses[i].enrolledStudents, courses[i].totalSeats);
-                strncat(result, line, BUFFER_SIZE - strlen(result) - 1);
-                int hasStudents = 0;
-                for (int j = 0; j < enrollments_size; j++) {
-                    if (enrollments[j].courseId == courses[i].id) {
-                        User* student = findUserById(enrollments[j].studentId);
-                        if (student) {
-                            sprintf(line, "- %s (ID: %d)\n", student->username, student->id);
-                            strncat(result, line, BUFFER_SIZE - strlen(result) - 1);
-                            hasStudents = 1;
-                        }
-                    }
-                }
-                if (!hasStudents) {
-                    strncat(result, "- No students enrolled yet\n", 
-                            BUFFER_SIZE - strlen(result) - 1);
-                }
-                hasCourses = 1;
-            }
-        }
-        releaseLock(COURSE_FILE);
-        releaseLock(ENROLLMENT_FILE);
-        if (!hasCourses) {
-            strcpy(response, "You have not offered any courses");
-        } else {
-            strcpy(response, result);
-        }
-        free(result);
-    }
-    else if (strcmp(command, "VIEW_COURSES") == 0) {
-        acquireReadLock(COURSE_FILE);
-        char* result = (char*)malloc(BUFFER_SIZE);
-        strcpy(result, "Your courses:\n");
-        int hasCourses = 0;
-        for (int i = 0; i < courses_size; i++) {
-            if (courses[i].facultyId == faculty->id) {
-                char line[256];
-                sprintf(line, "Code: %s, Name: %s, Enrollment: %d/%d\n", 
-                        courses[i].code, courses[i].name, 
-                        courses[i].enrolledStudents, courses[i].totalSeats);
-                strncat(result, line, BUFFER_SIZE - strlen(result) - 1);
-                hasCourses = 1;
-            }
+        int studentId = idQueuePop(waitlist);
+        UndoEntry* undo = undoEntry(UNDO_WAITLIST_REMOVED);
+        if (undo) {
+            undo->position = waitlist - courseWaitlists;
+            undo->studentId = studentId;
         }
-        releaseLock(COURSE_FILE);
-        if (!hasCourses) {
-            strcpy(response, "You have not offered any courses");
-        } else {
-            strcpy(response, result);
+        if (isEnrolled(studentId, course->id)) {
+            // Enrolled meanwhile; just drop the queue entry
+            releaseSeat(course);
+            finishLockedRecord(course->id, lockedRecord('L', studentId, course->id));
+            continue;
         }
-        free(result);
+        addEnrollment(studentId, course->id);
+        finishLockedRecord(course->id, lockedRecord('P', studentId, course->id));
+        promoted++;
     }
-    else if (strcmp(command, "CHANGE_PASSWORD") == 0) {
-        char* oldPassword = strtok(NULL, " ");
-        char* newPassword = strtok(NULL, " ");
-        if (!oldPassword || !newPassword) {
-            strcpy(response, "Invalid format");
-            return response;
-        }
-        if (strcmp(faculty->password, oldPassword) != 0) {
-            strcpy(response, "Incorrect current password");
-            return response;
+}
+
+// Set up the waitlists of the loaded courses from the snapshot or the
+// waitlist file
+void loadWaitlists() {
+    courseWaitlists = (IdQueue*)calloc(courses_size ? courses_size : 1, sizeof(IdQueue));
+    if (snapshot_waitlists) {
+        for (int i = 0; i < snapshot_waitlists_size; i++) {
+            IdQueue* waitlist = waitlistOf(snapshot_waitlists[i].courseId);
+            if (waitlist) idQueuePush(waitlist, snapshot_waitlists[i].studentId);
         }
-        strncpy(faculty->password, newPassword, MAX_STR-1);
-        faculty->password[MAX_STR-1] = '\0';
-        saveData();
-        strcpy(response, "Password changed successfully");
+        return;
     }
-    else {
-        strcpy(response, "Invalid faculty command");
+    FILE* file = fopen(WAITLIST_FILE, "r");
+    if (!file) return;
+    char line[1024];
+    while (fgets(line, sizeof(line), file)) {
+        int studentId, courseId;
+        if (sscanf(line, "%d %d", &studentId, &courseId) != 2) continue;
+        IdQueue* waitlist = waitlistOf(courseId);
+        if (waitlist) idQueuePush(waitlist, studentId);
     }
+    fclose(file);
+}
 
-    return response;
+// All waitlist entries as (student, course) pairs, course by course in queue
+// order. The array is the calling thread's, kept for its next save.
+Enrollment* flattenWaitlists(int* count) {
+    lockAllCourses();
+    int total = 0;
+    for (int i = 0; i < courses_size; i++) total += courseWaitlists[i].size;
+    if (total > flat_waitlists_cap) {
+        flat_waitlists_cap = total;
+        flat_waitlists = (Enrollment*)countedRealloc(flat_waitlists, total * sizeof(Enrollment));
+    }
+    Enrollment* entries = flat_waitlists;
+    int n = 0;
+    for (int i = 0; i < courses_size; i++) {
+        for (int j = 0; j < courseWaitlists[i].size; j++) {
+            entries[n].studentId = idQueueAt(&courseWaitlists[i], j);
+            entries[n].courseId = courses[i].id;
+            n++;
+        }
+    }
+    unlockAllCourses();
+    *count = n;
+    return entries;
 }
 
 // Find a user by ID
 User* findUserById(int id) {
-    for (int i = 0; i < users_size; i++) {
-        if (users[i].id == id) {
-            return &users[i];
+    if (!userIdIndex.slots) return NULL;
+    unsigned int mask = userIdIndex.capacity - 1;
+    for (unsigned int slot = hashInt(id) & mask; userIdIndex.slots[slot] != INDEX_EMPTY; slot = (slot + 1) & mask) {
+        int position = userIdIndex.slots[slot];
+        if (position >= 0 && users[position].id == id) {
+            return &users[position];
         }
     }
     return NULL;
@@ -821,9 +5237,12 @@ User* findUserById(int id) {
 
 // Find a user by username
 User* findUserByUsername(const char* username) {
-    for (int i = 0; i < users_size; i++) {
-        if (strcmp(users[i].username, username) == 0) {
-            return &users[i];
+    if (!usernameIndex.slots) return NULL;
+    unsigned int mask = usernameIndex.capacity - 1;
+    for (unsigned int slot = hashString(username) & mask; usernameIndex.slots[slot] != INDEX_EMPTY; slot = (slot + 1) & mask) {
+        int position = usernameIndex.slots[slot];
+        if (position >= 0 && strcmp(stringAt(users[position].username), username) == 0) {
+            return &users[position];
         }
     }
     return NULL;
@@ -831,9 +5250,12 @@ User* findUserByUsername(const char* username) {
 
 // Find a course by ID
 Course* findCourseById(int id) {
-    for (int i = 0; i < courses_size; i++) {
-        if (courses[i].id == id) {
-            return &courses[i];
+    if (!courseIdIndex.slots) return NULL;
+    unsigned int mask = courseIdIndex.capacity - 1;
+    for (unsigned int slot = hashInt(id) & mask; courseIdIndex.slots[slot] != INDEX_EMPTY; slot = (slot + 1) & mask) {
+        int position = courseIdIndex.slots[slot];
+        if (position >= 0 && courses[position].id == id) {
+            return &courses[position];
         }
     }
     return NULL;
@@ -841,9 +5263,12 @@ Course* findCourseById(int id) {
 
 // Find a course by code
 Course* findCourseByCode(const char* code) {
-    for (int i = 0; i < courses_size; i++) {
-        if (strcmp(courses[i].code, code) == 0) {
-            return &courses[i];
+    if (!courseCodeIndex.slots) return NULL;
+    unsigned int mask = courseCodeIndex.capacity - 1;
+    for (unsigned int slot = hashString(code) & mask; courseCodeIndex.slots[slot] != INDEX_EMPTY; slot = (slot + 1) & mask) {
+        int position = courseCodeIndex.slots[slot];
+        if (position >= 0 && strcmp(stringAt(courses[position].code), code) == 0) {
+            return &courses[position];
         }
     }
     return NULL;
@@ -851,39 +5276,65 @@ Course* findCourseByCode(const char* code) {
 
 // Check if a student is enrolled in a course
 int isEnrolled(int studentId, int courseId) {
-    for (int i = 0; i < enrollments_size; i++) {
-        if (enrollments[i].studentId == studentId && enrollments[i].courseId == courseId) {
-            return 1;
-        }
-    }
-    return 0;
+    pthread_mutex_lock(&enrollment_lock);
+    int position = findEnrollment(studentId, courseId);
+    pthread_mutex_unlock(&enrollment_lock);
+    return position >= 0;
 }
 
-// Acquire a read lock on a file
-void acquireReadLock(const char* filename) {
-    int fd = open(filename, O_RDONLY);
-    if (fd != -1) {
-        flock(fd, LOCK_SH); //allows multiple readers, but blocks writers
-        close(fd);
+// Set up the table lock (preferring writers, so a steady stream of readers
+// cannot starve structural changes) and the course lock stripes
+void initLocks() {
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&table_lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    for (int i = 0; i < COURSE_LOCK_STRIPES; i++) {
+        pthread_mutex_init(&course_locks[i], NULL);
     }
 }
 
-// Acquire a write lock on a file
-void acquireWriteLock(const char* filename) {
-    int fd = open(filename, O_WRONLY | O_CREAT, 0644);
-    if (fd != -1) {
-        flock(fd, LOCK_EX); //acquires an exclusive lock, blocking other readers and writers
-        close(fd);
-    }
+// Share the tables with other readers and enrollment changes
+void acquireReadLock() {
+    if (pthread_rwlock_tryrdlock(&table_lock) == 0) return;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_rwlock_rdlock(&table_lock);
+    countLockWait(&start);
 }
 
-// Release a lock on a file
-void releaseLock(const char* filename) {
-    int fd = open(filename, O_RDONLY);
-    if (fd != -1) {
-        flock(fd, LOCK_UN);
-        close(fd);
-    }
+// Take the tables exclusively, for structural changes
+void acquireWriteLock() {
+    if (pthread_rwlock_trywrlock(&table_lock) == 0) return;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_rwlock_wrlock(&table_lock);
+    countLockWait(&start);
+}
+
+// Release the table lock
+void releaseLock() {
+    pthread_rwlock_unlock(&table_lock);
+}
+
+// Serialize changes to one course's roster and waitlist; the caller holds
+// the table lock
+void lockCourse(int courseId) {
+    pthread_mutex_lock(&course_locks[hashInt(courseId) & (COURSE_LOCK_STRIPES - 1)]);
+}
+
+void unlockCourse(int courseId) {
+    pthread_mutex_unlock(&course_locks[hashInt(courseId) & (COURSE_LOCK_STRIPES - 1)]);
+}
+
+// Take every stripe, in order, to see all rosters and waitlists at once
+void lockAllCourses() {
+    for (int i = 0; i < COURSE_LOCK_STRIPES; i++) pthread_mutex_lock(&course_locks[i]);
+}
+
+void unlockAllCourses() {
+    for (int i = COURSE_LOCK_STRIPES - 1; i >= 0; i--) pthread_mutex_unlock(&course_locks[i]);
 }
 
 // strdup implementation for systems that lack it
@@ -896,15 +5347,135 @@ char* strdup(const char* s) {
     return new;
 }
 
-int main() {
-    // Initialize semaphore
+int main(int argc, char* argv[]) {
+    // Parse command line options
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--journal") == 0) {
+            journal_mode = 1;
+        } else if (strcmp(argv[i], "--epoll") == 0) {
+            epoll_mode = 1;
+        } else if (strcmp(argv[i], "--loops") == 0 && i + 1 < argc && atoi(argv[i+1]) > 0) {
+            event_loops = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--workers") == 0) {
+            // Optional thread count, defaulting to one worker per core
+            if (i + 1 < argc && atoi(argv[i+1]) > 0) {
+                worker_threads = atoi(argv[++i]);
+            } else {
+                worker_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+                if (worker_threads < 1) worker_threads = 1;
+            }
+        } else if (strcmp(argv[i], "--auth-threads") == 0 && i + 1 < argc && atoi(argv[i+1]) > 0) {
+            auth_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--snapshot") == 0) {
+            snapshot_mode = 1;
+        } else if (strcmp(argv[i], "--export") == 0) {
+            export_mode = 1;
+        } else if (strcmp(argv[i], "--bgsave") == 0) {
+            // Optional number of changes that triggers a save
+            bgsave_mode = 1;
+            if (i + 1 < argc && atoi(argv[i+1]) > 0) {
+                bgsave_changes = atoi(argv[++i]);
+            }
+        } else if (strcmp(argv[i], "--bgsave-interval") == 0 && i + 1 < argc && atoi(argv[i+1]) > 0) {
+            bgsave_interval = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc && atoi(argv[i+1]) > 0) {
+            metrics_port = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: %s [--journal | --bgsave [N] [--bgsave-interval S]] [--snapshot] [--export] "
+                    "[--epoll [--loops N]] [--workers [N]] [--metrics PORT]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (journal_mode && bgsave_mode) {
+        fprintf(stderr, "--journal and --bgsave cannot be combined\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Initialize the lock manager and semaphore
+    initLocks();
     sem_init(&mutex, 0, 1); //0 bcoz semaphors will be shared among diferent threads, and 1 is n
+    initCommandTable();
     
     // Set up signal handler
     signal(SIGINT, signalHandler);
     
     // Load data from files
     loadData();
+
+    // Write the loaded data (snapshot plus journal) back out as text and stop
+    if (export_mode) {
+        writeTextFiles(1);
+        printf("Exported %s, %s and %s\n", USER_FILE, COURSE_FILE, ENROLLMENT_FILE);
+        return 0;
+    }
+
+    // Fold any replayed records into a fresh checkpoint and start a new journal
+    if (journal_mode) {
+        openJournal();
+        journalCheckpoint(1);
+        printf("Journal mode enabled (%s)\n", JOURNAL_FILE);
+    }
+
+    // MEMORY counts what serving requests allocates, not what loading did
+    request_allocations = 0;
+
+    // Save in the background every bgsave_changes changes or bgsave_interval seconds
+    if (bgsave_mode) {
+        pthread_t scheduler;
+        if (pthread_create(&scheduler, NULL, bgsaveScheduler, NULL) != 0) {
+            perror("Background save thread creation failed");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(scheduler);
+        printf("Background saves enabled (every %d changes or %d s)\n", bgsave_changes, bgsave_interval);
+    }
+
+    // Otherwise rewrite the data files shortly after each burst of changes
+    if (!journal_mode && !bgsave_mode) {
+        pthread_t writer;
+        if (pthread_create(&writer, NULL, saveWriter, NULL) != 0) {
+            perror("Save writer thread creation failed");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(writer);
+    }
+
+    // Squeeze tombstones out of the tables once removals pile them up
+    pthread_t compactor_thread;
+    if (pthread_create(&compactor_thread, NULL, compactor, NULL) != 0) {
+        perror("Compactor thread creation failed");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(compactor_thread);
+
+    // Hash and check passwords on a few threads of their own
+    startAuthPool(auth_threads);
+    printf("Auth pool with %d threads\n", auth_threads);
+
+    // Serve metrics to local scrapers on their own port and thread
+    if (metrics_port) {
+        static int metrics_fd;
+        metrics_fd = socket(AF_INET, SOCK_STREAM, 0);
+        int reuse = 1;
+        setsockopt(metrics_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        struct sockaddr_in metrics_address;
+        memset(&metrics_address, 0, sizeof(metrics_address));
+        metrics_address.sin_family = AF_INET;
+        metrics_address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        metrics_address.sin_port = htons(metrics_port);
+        if (metrics_fd < 0 || bind(metrics_fd, (struct sockaddr *)&metrics_address, sizeof(metrics_address)) < 0 ||
+            listen(metrics_fd, MAX_CLIENTS) < 0) {
+            perror("Metrics listener failed");
+            exit(EXIT_FAILURE);
+        }
+        pthread_t metrics;
+        if (pthread_create(&metrics, NULL, metricsServer, &metrics_fd) != 0) {
+            perror("Metrics thread creation failed");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(metrics);
+        printf("Metrics on 127.0.0.1:%d\n", metrics_port);
+    }
     
     // Create a socket
     int server_fd = socket(AF_INET, SOCK_STREAM, 0);
@@ -940,6 +5511,27 @@ int main() {
     
     printf("Academia Portal Server started on port %d\n", PORT);
     printf("Waiting for connections...\n");
+
+    if (worker_threads) {
+        startWorkerPool(worker_threads);
+        printf("Worker pool with %d threads\n", worker_threads);
+    }
+
+    // Serve all connections from a fixed number of event loop threads
+    if (epoll_mode) {
+        fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL, 0) | O_NONBLOCK);
+        printf("Event loop mode with %d loops\n", event_loops);
+        pthread_t* loops = (pthread_t*)malloc(event_loops * sizeof(pthread_t));
+        for (int i = 0; i < event_loops; i++) {
+            if (pthread_create(&loops[i], NULL, eventLoop, &server_fd) != 0) {
+                perror("Thread creation failed");
+                exit(EXIT_FAILURE);
+            }
+        }
+        for (int i = 0; i < event_loops; i++) {
+            pthread_join(loops[i], NULL);
+        }
+    }
     
     // Accept and handle client connections
     while (1) {
@@ -977,9 +5569,9 @@ int main() {
     // Clean up (unreachable due to signal handler)
     close(server_fd);
     sem_destroy(&mutex);
-    free(users);
-    free(courses);
-    free(enrollments);
+    freeArray(users);
+    freeArray(courses);
+    freeArray(enrollments);
     
     return 0;
 }